@@ -0,0 +1,82 @@
+#ifndef _MEGA_BASE_EVENTQUEUE_INCLUDED
+#define _MEGA_BASE_EVENTQUEUE_INCLUDED
+
+#include "gcm.h"
+#include <atomic>
+#include <stddef.h>
+
+namespace karere
+{
+/** @brief Lock-free queue of the megaMessages posted to the karere thread.
+ * Any thread can push, but only the karere thread can pop. Messages are linked
+ * via their \c next member. Producers push them to a lock-free stack, and the
+ * consumer takes the whole stack at once and reverses it, so that messages
+ * are processed in the order they were posted.
+ */
+class EventQueue
+{
+protected:
+    /** The stack of pushed messages, newest first */
+    std::atomic<megaMessage*> mPushed;
+    /** Messages taken from mPushed and not yet popped, oldest first.
+     * Accessed only by the consumer */
+    megaMessage* mTaken = nullptr;
+
+public:
+    EventQueue(): mPushed(nullptr) {}
+    /** @brief Pushes the message, and returns \c true if the queue was empty.
+     * Only then the consumer needs to be woken up, as otherwise it has
+     * already been notified about the previous message, and will process
+     * this one as well */
+    bool push(void* event)
+    {
+        megaMessage* msg = static_cast<megaMessage*>(event);
+        msg->next = mPushed.load(std::memory_order_relaxed);
+        while (!mPushed.compare_exchange_weak(msg->next, msg,
+            std::memory_order_release, std::memory_order_relaxed));
+        return (msg->next == nullptr);
+    }
+    void* pop()
+    {
+        if (!mTaken)
+        {
+            megaMessage* msg = mPushed.exchange(nullptr, std::memory_order_acquire);
+            // reverse, to get the oldest first
+            while (msg)
+            {
+                megaMessage* next = msg->next;
+                msg->next = mTaken;
+                mTaken = msg;
+                msg = next;
+            }
+            if (!mTaken)
+            {
+                return NULL;
+            }
+        }
+        megaMessage* msg = mTaken;
+        mTaken = msg->next;
+        return msg;
+    }
+    bool isEmpty()
+    {
+        return !mTaken && !mPushed.load(std::memory_order_acquire);
+    }
+    /** Must be called only by the consumer */
+    size_t size()
+    {
+        size_t ret = 0;
+        for (megaMessage* msg = mTaken; msg; msg = msg->next)
+        {
+            ret++;
+        }
+        // nodes are never removed from the stack by anyone but us
+        for (megaMessage* msg = mPushed.load(std::memory_order_acquire); msg; msg = msg->next)
+        {
+            ret++;
+        }
+        return ret;
+    }
+};
+}
+#endif
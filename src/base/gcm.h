@@ -41,6 +41,11 @@ typedef void(*megaMessageFunc)(void*);
 struct megaMessage
 {
     megaMessageFunc func;
+    /** Link used by intrusive message queues, i.e. the queue of the thread that
+     * processes the message. It is owned by the queue while the message is in it,
+     * so posting a message does not need any allocation besides the message itself
+     */
+    struct megaMessage* next;
     /** If we don't provide an initializing constructor, operator new() will initialize
      * func to NULL, and then we will overwrite it, which is inefficient. That's why we
      * implement a constructor in case we are included in C++ code
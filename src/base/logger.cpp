@@ -4,6 +4,14 @@
 
 #include <stdarg.h>
 #include <string.h>
+#include <signal.h>
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 #define KRLOGGER_BUILDING //sets DLLIMPEXPs in logger.h to 'export' mode
 #include "logger.h"
 #include "loggerFile.h"
@@ -44,6 +52,309 @@ namespace karere
 */
 static size_t myStrncpy(char* dest, const char* src, size_t maxCount);
 
+/** @brief Asynchronous backend of the file logger.
+ * Log lines are copied to a ring buffer of fixed size slots. A line occupies
+ * one or more consecutive slots, prefixed with its length. Each slot has a
+ * sequence number, which tells whether it is free for the current round of
+ * the ring (== its position) or holds a published line (== position+1).
+ * Producers reserve slots with a CAS on the tail, so logging does not take
+ * any lock. The writer thread consumes the lines in order, and writes them to
+ * the file logger in batches, flushing once per batch.
+ */
+class AsyncLogWriter
+{
+protected:
+    enum { kSlotSize = 64, kWriteIntervalMs = 20 };
+    Logger& mLogger;
+    size_t mSlotCount; //power of 2
+    std::unique_ptr<std::atomic<uint64_t>[]> mSeq;
+    std::unique_ptr<char[]> mData;
+    std::atomic<uint64_t> mTail;
+    /** Written only by the consumer, with mWriteMutex held */
+    std::atomic<uint64_t> mHead;
+    std::atomic<uint64_t> mDropped;
+    uint64_t mDroppedReported = 0;
+    /** Serializes the consumers, i.e. the writer thread and flush() */
+    std::mutex mWriteMutex;
+    std::string mBatch;
+    std::mutex mWakeMutex;
+    std::condition_variable mWakeCond;
+    std::atomic<bool> mWakeupPending;
+    std::atomic<bool> mTerminate;
+    std::thread mThread;
+    /** The file the crash handler writes to, updated after each batch, as
+     * rotation reopens the file */
+    std::atomic<int> mCrashFd;
+    /** Preallocated, so that the crash handler doesn't need to allocate */
+    std::unique_ptr<char[]> mCrashBuf;
+    static std::atomic<AsyncLogWriter*> sCrashWriter;
+#ifndef _WIN32
+    static struct sigaction sPrevActions[NSIG];
+    static const int sCrashSignals[];
+#endif
+    size_t mask() const { return mSlotCount - 1; }
+    void copyIn(uint64_t pos, size_t offset, const char* src, size_t len)
+    {
+        size_t bufSize = mSlotCount * kSlotSize;
+        size_t start = ((pos & mask()) * kSlotSize + offset) % bufSize;
+        size_t first = std::min(len, bufSize - start);
+        memcpy(mData.get() + start, src, first);
+        memcpy(mData.get(), src + first, len - first);
+    }
+    void copyOut(uint64_t pos, size_t offset, size_t len, std::string& dest)
+    {
+        size_t bufSize = mSlotCount * kSlotSize;
+        size_t start = ((pos & mask()) * kSlotSize + offset) % bufSize;
+        size_t first = std::min(len, bufSize - start);
+        dest.append(mData.get() + start, first);
+        dest.append(mData.get(), len - first);
+    }
+    /** Consumes all published lines, passing each to \c sink(pos, len), where
+     * the line data is at offset sizeof(uint32_t) of the slot at \c pos.
+     * mWriteMutex must be held */
+    template <class F>
+    void consume(F&& sink)
+    {
+        uint64_t head = mHead.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            auto& seq = mSeq[head & mask()];
+            if (seq.load(std::memory_order_acquire) != head + 1)
+                break;
+            uint32_t len;
+            memcpy(&len, mData.get() + (head & mask()) * kSlotSize, sizeof(len));
+            sink(head, len);
+            uint64_t count = (sizeof(len) + len + kSlotSize - 1) / kSlotSize;
+            //free the slots in order, producers check only the last slot they need
+            for (uint64_t i = 0; i < count; i++)
+            {
+                mSeq[(head + i) & mask()].store(head + i + mSlotCount, std::memory_order_release);
+            }
+            head += count;
+            mHead.store(head, std::memory_order_release);
+        }
+    }
+    /** Moves all published lines to mBatch. mWriteMutex must be held */
+    void drain()
+    {
+        consume([this](uint64_t pos, uint32_t len)
+        {
+            copyOut(pos, sizeof(len), len, mBatch);
+        });
+        uint64_t dropped = mDropped.load(std::memory_order_relaxed);
+        if (dropped != mDroppedReported)
+        {
+            mBatch.append("[LOGGER] Log buffer full, dropped ")
+                  .append(std::to_string(dropped - mDroppedReported))
+                  .append(" lines\n");
+            mDroppedReported = dropped;
+        }
+    }
+    /** Writes mBatch to the file. mWriteMutex must be held */
+    void writeBatch()
+    {
+        if (mBatch.empty())
+            return;
+        if (mLogger.mFileLogger)
+        {
+            mLogger.mFileLogger->logString(mBatch.data(), mBatch.size(), mLogger.mFlags);
+            updateCrashFd();
+        }
+        mBatch.clear();
+    }
+    void threadLoop()
+    {
+        while (!mTerminate.load())
+        {
+            {
+                std::unique_lock<std::mutex> lock(mWakeMutex);
+                mWakeCond.wait_for(lock, std::chrono::milliseconds(kWriteIntervalMs),
+                    [this]() { return mWakeupPending.load() || mTerminate.load(); });
+            }
+            mWakeupPending = false;
+            flush();
+        }
+        flush();
+    }
+#ifndef _WIN32
+    /** Writes the queued lines directly to the file. Doesn't allocate or use
+     * stdio, which could deadlock if the crash happened inside malloc. Lines
+     * that the writer thread has already taken but not yet written are lost */
+    static void crashHandler(int sig)
+    {
+        AsyncLogWriter* self = sCrashWriter.exchange(nullptr);
+        if (self && self->mCrashFd >= 0 && self->mWriteMutex.try_lock())
+        {
+            char* buf = self->mCrashBuf.get();
+            size_t bufSize = self->mSlotCount * kSlotSize;
+            size_t size = 0;
+            self->consume([self, buf, bufSize, &size](uint64_t pos, uint32_t len)
+            {
+                size_t start = ((pos & self->mask()) * kSlotSize + sizeof(len)) % bufSize;
+                size_t first = std::min<size_t>(len, bufSize - start);
+                memcpy(buf + size, self->mData.get() + start, first);
+                memcpy(buf + size + first, self->mData.get(), len - first);
+                size += len;
+            });
+            for (size_t written = 0; written < size; )
+            {
+                auto ret = ::write(self->mCrashFd, buf + written, size - written);
+                if (ret <= 0)
+                    break;
+                written += ret;
+            }
+            self->mWriteMutex.unlock();
+        }
+        //the signal is blocked while we are in the handler, so it is delivered
+        //to the previous handler when we return
+        sigaction(sig, &sPrevActions[sig], nullptr);
+        raise(sig);
+    }
+    void installCrashHandler()
+    {
+        AsyncLogWriter* expected = nullptr;
+        if (!sCrashWriter.compare_exchange_strong(expected, this))
+            return; //another writer is already registered
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = crashHandler;
+        sigemptyset(&action.sa_mask);
+        for (int i = 0; sCrashSignals[i]; i++)
+        {
+            sigaction(sCrashSignals[i], &action, &sPrevActions[sCrashSignals[i]]);
+        }
+    }
+    void removeCrashHandler()
+    {
+        AsyncLogWriter* expected = this;
+        if (!sCrashWriter.compare_exchange_strong(expected, nullptr))
+            return;
+        for (int i = 0; sCrashSignals[i]; i++)
+        {
+            int sig = sCrashSignals[i];
+            //don't remove a handler that someone installed after us
+            struct sigaction current;
+            if (sigaction(sig, nullptr, &current) == 0 && current.sa_handler == crashHandler)
+            {
+                sigaction(sig, &sPrevActions[sig], nullptr);
+            }
+        }
+    }
+#else
+    void installCrashHandler() {}
+    void removeCrashHandler() {}
+#endif
+public:
+    AsyncLogWriter(Logger& logger, size_t bufSize)
+    : mLogger(logger), mSlotCount(64), mTail(0), mHead(0), mDropped(0),
+      mWakeupPending(false), mTerminate(false), mCrashFd(-1)
+    {
+        while (mSlotCount * kSlotSize < bufSize)
+            mSlotCount <<= 1;
+        mSeq.reset(new std::atomic<uint64_t>[mSlotCount]);
+        for (size_t i = 0; i < mSlotCount; i++)
+        {
+            mSeq[i].store(i, std::memory_order_relaxed);
+        }
+        mData.reset(new char[mSlotCount * kSlotSize]);
+        mCrashBuf.reset(new char[mSlotCount * kSlotSize]);
+        updateCrashFd();
+        mThread = std::thread([this]() { threadLoop(); });
+        installCrashHandler();
+    }
+    ~AsyncLogWriter()
+    {
+        removeCrashHandler();
+        mTerminate = true;
+        mWakeCond.notify_one();
+        mThread.join();
+    }
+    /** Queues a log line. Never blocks, drops the line if the buffer is full */
+    void push(const char* msg, size_t len)
+    {
+        uint32_t hdr;
+        //a single line can't take more than a quarter of the buffer
+        size_t maxLen = mSlotCount * kSlotSize / 4 - sizeof(hdr);
+        if (len > maxLen)
+            len = maxLen;
+        hdr = (uint32_t)len;
+        uint64_t count = (sizeof(hdr) + len + kSlotSize - 1) / kSlotSize;
+        uint64_t pos = mTail.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            uint64_t last = pos + count - 1;
+            uint64_t seq = mSeq[last & mask()].load(std::memory_order_acquire);
+            if (seq == last)
+            {
+                if (mTail.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+                    break;
+            }
+            else if (seq < last)
+            {
+                mDropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else
+            {
+                pos = mTail.load(std::memory_order_relaxed);
+            }
+        }
+        copyIn(pos, 0, (const char*)&hdr, sizeof(hdr));
+        copyIn(pos, sizeof(hdr), msg, len);
+        mSeq[pos & mask()].store(pos + 1, std::memory_order_release);
+
+        //wake up the writer early if the buffer is getting full
+        if ((pos + count - mHead.load(std::memory_order_relaxed)) * 2 > mSlotCount
+         && !mWakeupPending.exchange(true))
+        {
+            mWakeCond.notify_one();
+        }
+    }
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mWriteMutex);
+        drain();
+        writeBatch();
+    }
+    std::unique_lock<std::mutex> lockWrite()
+    {
+        return std::unique_lock<std::mutex>(mWriteMutex);
+    }
+    /** Points the crash handler to the current log file, or to none if file
+     * logging is disabled. mWriteMutex must be held, or the writer thread
+     * not be running yet */
+    void updateCrashFd()
+    {
+        mCrashFd = mLogger.mFileLogger ? mLogger.mFileLogger->fd() : -1;
+    }
+    uint64_t dropped() const { return mDropped.load(std::memory_order_relaxed); }
+};
+
+std::atomic<AsyncLogWriter*> AsyncLogWriter::sCrashWriter(nullptr);
+#ifndef _WIN32
+struct sigaction AsyncLogWriter::sPrevActions[NSIG];
+const int AsyncLogWriter::sCrashSignals[] = { SIGSEGV, SIGABRT, SIGFPE, SIGILL, SIGBUS, 0 };
+#endif
+
+/** Gives access to the async writer of a logger, if any, and keeps it alive
+ * while in scope */
+class AsyncWriterRef
+{
+protected:
+    std::atomic<int>& mUsers;
+    AsyncLogWriter* mWriter;
+public:
+    AsyncWriterRef(const std::atomic<AsyncLogWriter*>& writer, std::atomic<int>& users)
+    : mUsers(users)
+    {
+        mUsers.fetch_add(1);
+        mWriter = writer.load();
+    }
+    ~AsyncWriterRef() { mUsers.fetch_sub(1); }
+    AsyncLogWriter* operator->() const { return mWriter; }
+    explicit operator bool() const { return mWriter != nullptr; }
+};
+
 void Logger::logToConsole(bool enable)
 {
     if (enable)
@@ -70,13 +381,61 @@ void Logger::logToConsoleUseColors(bool useColors)
 
 void Logger::logToFile(const char* fileName, size_t rotateSizeKb)
 {
+    //the async writer must not be writing while the file logger changes
+    AsyncWriterRef writer(mAsyncWriter, mAsyncWriterUsers);
+    std::unique_lock<std::mutex> lock;
+    if (writer)
+    {
+        writer->flush();
+        lock = writer->lockWrite();
+    }
     if (!fileName) //disable
     {
         mFileLogger.reset();
-        return;
     }
-    //re-configure
-    mFileLogger.reset(new FileLogger(mFlags, fileName, rotateSizeKb*1024));
+    else //re-configure
+    {
+        mFileLogger.reset(new FileLogger(mFlags, fileName, rotateSizeKb*1024));
+    }
+    //the crash handler must not write to the fd of the old file
+    if (writer)
+        writer->updateCrashFd();
+}
+
+void Logger::setAsyncFileLogging(bool enable, size_t bufSizeKb)
+{
+    LockGuard lock(mMutex);
+    if (enable)
+    {
+        if (mAsyncWriter)
+            return;
+        mAsyncWriter = new AsyncLogWriter(*this, bufSizeKb*1024);
+    }
+    else
+    {
+        AsyncLogWriter* writer = mAsyncWriter.exchange(nullptr);
+        if (!writer)
+            return;
+        //wait for the threads that may have loaded the pointer before the
+        //exchange. New ones will see nullptr
+        while (mAsyncWriterUsers.load())
+            std::this_thread::yield();
+        //the destructor flushes the queue
+        delete writer;
+    }
+}
+
+void Logger::flush()
+{
+    AsyncWriterRef writer(mAsyncWriter, mAsyncWriterUsers);
+    if (writer)
+        writer->flush();
+}
+
+uint64_t Logger::droppedLogLines() const
+{
+    AsyncWriterRef writer(mAsyncWriter, mAsyncWriterUsers);
+    return writer ? writer->dropped() : 0;
 }
 
 void Logger::setAutoFlush(bool enable)
@@ -88,7 +447,7 @@ void Logger::setAutoFlush(bool enable)
 }
 
 Logger::Logger(unsigned aFlags, const char* timeFmt)
-    :mTimeFmt(timeFmt), mFlags(aFlags)
+    :mTimeFmt(timeFmt), mAsyncWriter(nullptr), mAsyncWriterUsers(0), mFlags(aFlags)
 {
     setup();
     setupFromEnvVar();
@@ -187,7 +546,13 @@ void Logger::logString(krLogLevel level, const char* msg, unsigned flags, size_t
     if (mConsoleLogger && ((flags & krLogNoConsole) == 0))
         mConsoleLogger->logString(level, msg, flags);
     if ((mFileLogger) && ((flags & krLogNoFile) == 0))
-        mFileLogger->logString(msg, len, flags);
+    {
+        AsyncWriterRef writer(mAsyncWriter, mAsyncWriterUsers);
+        if (writer)
+            writer->push(msg, len);
+        else
+            mFileLogger->logString(msg, len, flags);
+    }
     if (!mUserLoggers.empty())
     {
         for (auto& logger: mUserLoggers)
@@ -213,6 +578,13 @@ std::shared_ptr<Logger::LogBuffer> Logger::loadLog()
     if (!mFileLogger)
         return NULL;
     LockGuard lock(mMutex);
+    AsyncWriterRef writer(mAsyncWriter, mAsyncWriterUsers);
+    std::unique_lock<std::mutex> writeLock;
+    if (writer)
+    {
+        writer->flush();
+        writeLock = writer->lockWrite();
+    }
     return mFileLogger->loadLog();
 }
 
@@ -225,6 +597,8 @@ Logger::~Logger()
     }
     if ((mFlags & krLogNoTerminateMessage) == 0)
         log("LOGGER", 0, 0, "========== Application terminate ===========\n");
+    //flush the queue while the file logger still exists
+    setAsyncFileLogging(false);
 }
 
 Logger::ILoggerBackend* Logger::addUserLogger(const char* tag, ILoggerBackend* logger)
@@ -65,12 +65,15 @@ enum { krLogChannelCount = 32 };
 #include <string>
 #include <memory>
 #include <mutex>
+#include <atomic>
 #include <map>
+#include <stdint.h>
 
 namespace karere
 {
 class FileLogger;
 class ConsoleLogger;
+class AsyncLogWriter;
 
 class KRLOGGER_DLLIMPEXP Logger
 {
@@ -83,6 +86,12 @@ protected:
     void setupFromEnvVar();
     std::unique_ptr<FileLogger> mFileLogger;
     std::unique_ptr<ConsoleLogger> mConsoleLogger;
+    /** If set, the lines for the file logger are queued to it, and written by
+     * its thread. It is accessed without locking mMutex, so it is published
+     * atomically, and deleted only after all threads using it (counted by
+     * mAsyncWriterUsers) are done with it */
+    std::atomic<AsyncLogWriter*> mAsyncWriter;
+    mutable std::atomic<int> mAsyncWriterUsers;
     volatile unsigned mFlags;
     size_t prependInfo(char *buf, size_t bufSize, const char* prefix, const char* severity, unsigned flags);
 
@@ -90,6 +99,7 @@ protected:
      *  of an assembled single string */
     void logString(krLogLevel level, const char* msg, unsigned flags, size_t len=(size_t)-1);
     std::map<std::string, ILoggerBackend*> mUserLoggers;
+    friend class AsyncLogWriter;
 public:
     std::recursive_mutex mMutex;
     typedef std::lock_guard<std::recursive_mutex> LockGuard;
@@ -105,6 +115,19 @@ public:
     void logToConsoleUseColors(bool useColors);
     void logToFile(const char* fileName, size_t rotateSize);
     void setAutoFlush(bool enable=true);
+    /** @brief Makes the file logger asynchronous. Log lines are queued in a
+     * lock-free ring buffer of \c bufSizeKb KB, and written to the file in batches
+     * by a dedicated thread. If the buffer is full, lines are dropped and counted.
+     * The buffer is flushed when async logging is disabled, when the logger is
+     * destroyed and, as far as possible, when the process crashes.
+     */
+    void setAsyncFileLogging(bool enable=true, size_t bufSizeKb=1024);
+    /** @brief Writes all queued log lines to the file. Does nothing if the file
+     * logger is not asynchronous */
+    void flush();
+    /** @brief The number of lines dropped by the async file logger because its
+     * buffer was full */
+    uint64_t droppedLogLines() const;
     Logger(unsigned flags = 0, const char* timeFmt="%m-%d %H:%M:%S");
     void logv(const char* prefix, krLogLevel level, unsigned flags, const char* fmtString, va_list aVaList);
     void log(const char* prefix, krLogLevel level, unsigned flags,
@@ -16,6 +16,8 @@ protected:
     long mLogSize;
 public:
     void setRotateSize(unsigned rotateSize) { mRotateSize = rotateSize; }
+    /** The descriptor of the log file, or -1 if it is not open */
+    int fd() const { return mFile ? fileno(mFile) : -1; }
 
 FileLogger(volatile unsigned& flags, const char* logFile, int rotateSize)
  :mFile(NULL), mRotateSize(rotateSize), mFlags(flags), mLogSize(0)
@@ -0,0 +1,60 @@
+#ifndef _MEGA_BASE_SNAPSHOTMAP_INCLUDED
+#define _MEGA_BASE_SNAPSHOTMAP_INCLUDED
+
+#include <map>
+#include <memory>
+#include <utility>
+#include <stdint.h>
+
+namespace karere
+{
+/** @brief A map that is read through immutable, versioned snapshots. A single
+ * writer thread publishes a new snapshot on every change, as a copy-on-write of
+ * the map of shared value pointers, and any thread can use the latest snapshot
+ * without taking a lock.
+ */
+template <class K, class V>
+class SnapshotMap
+{
+public:
+    struct Snapshot
+    {
+        uint64_t version = 0;
+        std::map<K, std::shared_ptr<const V>> items;
+    };
+protected:
+    /** Accessed only with std::atomic_load() / std::atomic_store() */
+    std::shared_ptr<const Snapshot> mCurrent;
+public:
+    /** @brief The latest snapshot, or null if none was published after the
+     * last \c clear(). Can be called from any thread */
+    std::shared_ptr<const Snapshot> get() const
+    {
+        return std::atomic_load(&mCurrent);
+    }
+    /** @brief Publishes a snapshot where the value of \c key is replaced by
+     * \c value, or removed if \c value is null. Must be called only by the
+     * writer thread. Readers keep using the previous snapshot until they are done
+     */
+    void publish(const K& key, std::shared_ptr<const V> value)
+    {
+        auto current = get();
+        auto snapshot = current ? std::make_shared<Snapshot>(*current) : std::make_shared<Snapshot>();
+        snapshot->version++;
+        if (value)
+        {
+            snapshot->items[key] = std::move(value);
+        }
+        else
+        {
+            snapshot->items.erase(key);
+        }
+        std::atomic_store(&mCurrent, std::shared_ptr<const Snapshot>(std::move(snapshot)));
+    }
+    void clear()
+    {
+        std::atomic_store(&mCurrent, std::shared_ptr<const Snapshot>());
+    }
+};
+}
+#endif
@@ -24,117 +24,369 @@
 #include "cservices.h"
 #include "gcmpp.h"
 #include <memory>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
 #include <assert.h>
-extern std::recursive_mutex timerMutex;
 
 namespace karere
 {
-struct TimerMsg: public megaMessage
+class TimerWheel;
+
+#ifdef USE_LIBWEBSOCKETS
+    void init_uv_timer(void *ctx, uv_timer_t *timer);
+#else
+    eventloop *get_ev_loop(void *ctx);
+#endif
+/** Returns the timer wheel of the app context \c ctx. All timers of a context are
+ * managed by its wheel, which must only be accessed by the code that runs in that
+ * context, i.e. from the GUI thread, or with the context's mutex held
+ */
+    TimerWheel& get_timer_wheel(void *ctx);
+
+/** @brief Link of the circular doubly-linked lists of timers, one per wheel
+ * slot. A timer can be unlinked in O(1) without knowing the slot it is in */
+struct TimerLink
 {
-    timerevent* timerEvent = nullptr;
+    TimerLink* prev;
+    TimerLink* next;
+    TimerLink(): prev(this), next(this) {}
+    bool isLinked() const { return next != this; }
+    void unlink()
+    {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = this;
+    }
+    void linkBefore(TimerLink* pos)
+    {
+        prev = pos->prev;
+        next = pos;
+        pos->prev->next = this;
+        pos->prev = this;
+    }
+    /** Moves the whole list of \c head to this list head, which must be empty */
+    void takeList(TimerLink& head)
+    {
+        assert(!isLinked());
+        if (!head.isLinked())
+            return;
+        prev = head.prev;
+        next = head.next;
+        prev->next = next->prev = this;
+        head.prev = head.next = &head;
+    }
+};
+
+/** @brief A timer scheduled in a TimerWheel */
+struct WheelTimer: public TimerLink
+{
+    uint64_t expires = 0; //in ticks
+    unsigned period = 0; //in ticks, 0 for one-shot timers
+    megaHandle handle = 0;
     bool canceled = false;
-    megaHandle handle;
-    TimerMsg(megaMessageFunc aFunc)
-        :megaMessage(aFunc),
-          handle(services_hstore_add_handle(MEGA_HTYPE_TIMER, this))
-    {}
-   ~TimerMsg()
+    virtual ~WheelTimer() {}
+    virtual void fire() = 0;
+};
+
+/** @brief Hierarchical timer wheel, holding all timers of an app context.
+ * A tick is one millisecond. The first level has a slot for each of the next
+ * 256 ticks, and each of the other four levels has 64 slots that span 64 slots
+ * of the level below. When the first level wraps around, the current slot of the
+ * second level is redistributed to the first one, and so on (cascading).
+ * Adding and canceling a timer are O(1), and a single loop timer (the driver) is
+ * armed for the earliest slot that has timers. When it fires, it posts a single
+ * message to the app context, which processes all the expired timers.
+ */
+class TimerWheel
+{
+protected:
+    enum: unsigned { kL0Bits = 8, kLnBits = 6, kLevels = 5,
+                     kL0Size = 1 << kL0Bits, kLnSize = 1 << kLnBits };
+    struct TickMsg: public megaMessage
+    {
+        TimerWheel* wheel;
+        TickMsg(TimerWheel* aWheel)
+        : megaMessage([](void* arg) { static_cast<TickMsg*>(arg)->wheel->onTick(); }),
+          wheel(aWheel) {}
+    };
+    void* mCtx;
+    std::chrono::steady_clock::time_point mEpoch;
+    /** The next tick to be processed. All timers expiring before it have fired */
+    uint64_t mNow = 0;
+    TimerLink mL0[kL0Size];
+    TimerLink mLn[kLevels-1][kLnSize];
+    std::unordered_map<megaHandle, WheelTimer*> mTimers;
+    megaHandle mHandleCtr = 0;
+    /** The timer whose callback is being called, if any */
+    WheelTimer* mRunning = nullptr;
+    TickMsg mTickMsg;
+    /** Set by the driver, which may run in the thread of the event loop,
+     * and cleared by the tick handler */
+    std::atomic<bool> mTickPosted;
+    /** The tick the driver is armed for, or UINT64_MAX if it is not armed */
+    uint64_t mArmedAt = UINT64_MAX;
+#ifndef USE_LIBWEBSOCKETS
+    timerevent* mDriver = nullptr;
+#else
+    uv_timer_t* mDriver = nullptr;
+    bool mArmPosted = false;
+#endif
+    uint64_t elapsedTicks() const
     {
-        services_hstore_remove_handle(MEGA_HTYPE_TIMER, handle);
-        if (timerEvent)
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - mEpoch).count();
+    }
+    static unsigned levelShift(unsigned level) { return kL0Bits + (level - 1) * kLnBits; }
+    void schedule(WheelTimer* timer)
+    {
+        uint64_t expires = (timer->expires < mNow) ? mNow : timer->expires;
+        uint64_t delta = expires - mNow;
+        if (delta < kL0Size)
+        {
+            timer->linkBefore(&mL0[expires & (kL0Size - 1)]);
+            return;
+        }
+        unsigned level = 1;
+        while ((level < kLevels - 1) && (delta >> levelShift(level + 1)))
+            level++;
+        if (delta >> levelShift(kLevels))
+        {
+            //beyond the span of the wheel, it will be cascaded again
+            expires = mNow + (uint64_t(1) << levelShift(kLevels)) - 1;
+        }
+        timer->linkBefore(&mLn[level-1][(expires >> levelShift(level)) & (kLnSize - 1)]);
+    }
+    /** Redistributes the current slot of \c level to the lower levels.
+     * @returns the index of that slot, so that the caller knows whether the
+     * upper level has to be cascaded as well */
+    unsigned cascade(unsigned level)
+    {
+        unsigned idx = (mNow >> levelShift(level)) & (kLnSize - 1);
+        TimerLink list;
+        list.takeList(mLn[level-1][idx]);
+        while (list.isLinked())
+        {
+            WheelTimer* timer = static_cast<WheelTimer*>(list.next);
+            timer->unlink();
+            schedule(timer);
+        }
+        return idx;
+    }
+    /** Fires the timers of \c list. It is detached from the wheel and mNow is
+     * already past its tick, so timers added or rescheduled by the callbacks
+     * go to later slots. Timers canceled by a callback are unlinked from it */
+    void run(TimerLink& list)
+    {
+        while (list.isLinked())
+        {
+            WheelTimer* timer = static_cast<WheelTimer*>(list.next);
+            timer->unlink();
+            if (!timer->period)
+            {
+                mTimers.erase(timer->handle);
+            }
+            mRunning = timer;
+            timer->fire();
+            mRunning = nullptr;
+            if (!timer->period || timer->canceled)
+            {
+                delete timer;
+                continue;
+            }
+            timer->expires = mNow - 1 + timer->period;
+            schedule(timer);
+        }
+    }
+    void advance(uint64_t target)
+    {
+        if (mTimers.empty())
         {
-            #ifndef USE_LIBWEBSOCKETS
-                event_free(timerEvent);
-            #else
-                uv_close((uv_handle_t *)timerEvent, [](uv_handle_t* handle)
+            mNow = target + 1;
+            return;
+        }
+        while (mNow <= target)
+        {
+            unsigned idx = mNow & (kL0Size - 1);
+            if (!idx)
+            {
+                for (unsigned level = 1; level < kLevels; level++)
                 {
-                    delete handle;
-                });
-            #endif
+                    if (cascade(level))
+                        break;
+                }
+            }
+            TimerLink list;
+            list.takeList(mL0[idx]);
+            mNow++;
+            run(list);
         }
     }
-};
-
-#ifdef USE_LIBWEBSOCKETS
-    void init_uv_timer(void *ctx, uv_timer_t *timer);
+    /** Returns the earliest tick when some timer expires or has to be cascaded,
+     * or UINT64_MAX if there are no timers */
+    uint64_t nextEvent() const
+    {
+        uint64_t next = UINT64_MAX;
+        if (mTimers.empty())
+            return next;
+        for (unsigned i = 0; i < kL0Size; i++)
+        {
+            if (mL0[i].isLinked())
+            {
+                uint64_t at = (mNow & ~uint64_t(kL0Size - 1)) | i;
+                if (at < mNow)
+                    at += kL0Size;
+                if (at < next)
+                    next = at;
+            }
+        }
+        for (unsigned level = 1; level < kLevels; level++)
+        {
+            unsigned shift = levelShift(level);
+            uint64_t span = uint64_t(kLnSize) << shift;
+            for (unsigned i = 0; i < kLnSize; i++)
+            {
+                if (!mLn[level-1][i].isLinked())
+                    continue;
+                //the slot is cascaded when its index comes up at a boundary of its level
+                uint64_t at = (mNow & ~(span - 1)) | (uint64_t(i) << shift);
+                if (at < mNow)
+                    at += span;
+                if (at < next)
+                    next = at;
+            }
+        }
+        return next;
+    }
+    void arm(uint64_t at)
+    {
+        if (mArmedAt <= at)
+            return;
+        mArmedAt = at;
+        uint64_t now = elapsedTicks();
+        unsigned delay = (at > now) ? (unsigned)(at - now) : 0;
+#ifndef USE_LIBWEBSOCKETS
+        if (!mDriver)
+        {
+            mDriver = evtimer_new(get_ev_loop(mCtx),
+            [](evutil_socket_t fd, short what, void* evarg)
+            {
+                static_cast<TimerWheel*>(evarg)->postTick();
+            }, this);
+        }
+        struct timeval tv;
+        tv.tv_sec = delay / 1000;
+        tv.tv_usec = (delay % 1000)*1000;
+        evtimer_add(mDriver, &tv);
 #else
-    eventloop *get_ev_loop(void *ctx);
+        //libuv handles must only be used from the thread of the loop
+        if (mArmPosted)
+            return;
+        mArmPosted = true;
+        marshallCall([this]()
+        {
+            mArmPosted = false;
+            if (!mDriver)
+            {
+                mDriver = new uv_timer_t();
+                mDriver->data = this;
+                init_uv_timer(mCtx, mDriver);
+            }
+            uint64_t now = elapsedTicks();
+            uv_timer_start(mDriver, [](uv_timer_t* handle)
+            {
+                static_cast<TimerWheel*>(handle->data)->postTick();
+            }, (mArmedAt > now) ? (mArmedAt - now) : 0, 0);
+        }, mCtx);
 #endif
-    
+    }
+    void postTick()
+    {
+        if (mTickPosted.exchange(true))
+            return;
+        megaPostMessageToGui(&mTickMsg, mCtx);
+    }
+    void onTick()
+    {
+        mTickPosted = false;
+        mArmedAt = UINT64_MAX;
+        advance(elapsedTicks());
+        arm(nextEvent());
+    }
+public:
+    TimerWheel(void* ctx)
+    : mCtx(ctx), mEpoch(std::chrono::steady_clock::now()), mTickMsg(this),
+      mTickPosted(false)
+    {}
+    ~TimerWheel()
+    {
+        for (auto& item: mTimers)
+        {
+            delete item.second;
+        }
+#ifndef USE_LIBWEBSOCKETS
+        if (mDriver)
+        {
+            event_free(mDriver);
+        }
+#else
+        if (mDriver)
+        {
+            uv_close((uv_handle_t *)mDriver, [](uv_handle_t* handle)
+            {
+                delete handle;
+            });
+        }
+#endif
+    }
+    /** Takes ownership of \c timer and schedules it to fire after \c time ms,
+     * repeatedly if \c persist is set. Returns the handle of the timer */
+    megaHandle add(WheelTimer* timer, unsigned time, bool persist)
+    {
+        megaHandle handle = ++mHandleCtr;
+        if (!handle) //wrapped around
+            handle = ++mHandleCtr;
+        timer->handle = handle;
+        timer->period = persist ? (time ? time : 1) : 0;
+        timer->expires = elapsedTicks() + time;
+        mTimers[handle] = timer;
+        schedule(timer);
+        arm(timer->expires);
+        return handle;
+    }
+    /** Cancels and deletes the timer.
+     * @returns \c false if the handle is not valid */
+    bool cancel(megaHandle handle)
+    {
+        auto it = mTimers.find(handle);
+        if (it == mTimers.end())
+            return false;
+        WheelTimer* timer = it->second;
+        mTimers.erase(it);
+        if (timer == mRunning)
+        {
+            //deleted by run() when the callback returns
+            timer->canceled = true;
+            return true;
+        }
+        timer->unlink();
+        delete timer;
+        return true;
+    }
+    size_t size() const { return mTimers.size(); }
+};
+
 template <int persist, class CB>
 inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
 {
-    struct Msg: public TimerMsg
+    struct Timer: public WheelTimer
     {
         CB cb;
-        void *appCtx;
-        Msg(CB&& aCb, megaMessageFunc cFunc)
-        :TimerMsg(cFunc), cb(aCb)
-        {}
-        unsigned time;
-        int loop;
+        Timer(CB&& aCb): cb(std::forward<CB>(aCb)) {}
+        virtual void fire() { cb(); }
     };
-    megaMessageFunc cfunc = persist
-        ? (megaMessageFunc) [](void* arg)
-          {
-              Msg* msg = static_cast<Msg*>(arg);
-              if (msg->canceled)
-                  return;
-              msg->cb();
-          }
-        : (megaMessageFunc) [](void* arg)
-          {
-              timerMutex.lock();
-              Msg* msg = static_cast<Msg*>(arg);
-              if (msg->canceled)
-              {
-                  timerMutex.unlock();
-                  return;
-              }
-              msg->cb();
-              if (msg->canceled)
-              {
-                  timerMutex.unlock();
-                  return;
-              }
-              delete msg;
-              timerMutex.unlock();
-          };
-
-    timerMutex.lock();
-    Msg* pMsg = new Msg(std::forward<CB>(callback), cfunc);
-    timerMutex.unlock();
-
-    pMsg->appCtx = ctx;
-    pMsg->time = time;
-    pMsg->loop = persist;
-    
-#ifndef USE_LIBWEBSOCKETS
-    pMsg->timerEvent = event_new(get_ev_loop(ctx), -1, persist,
-      [](evutil_socket_t fd, short what, void* evarg)
-      {
-            megaPostMessageToGui(evarg, ((Msg* )evarg)->appCtx);
-      }, pMsg);
-
-    struct timeval tv;
-    tv.tv_sec = time / 1000;
-    tv.tv_usec = (time % 1000)*1000;
-    evtimer_add(pMsg->timerEvent, &tv);
-#else
-    marshallCall([pMsg, ctx]()
-    {
-        pMsg->timerEvent = new uv_timer_t();
-        pMsg->timerEvent->data = pMsg;
-        init_uv_timer(ctx, pMsg->timerEvent);
-        uv_timer_start(pMsg->timerEvent,
-                       [](uv_timer_t* handle)
-                       {
-                           megaPostMessageToGui(handle->data, ((Msg*)handle->data)->appCtx);
-                       }, pMsg->time, pMsg->loop ? pMsg->time : 0);
-    }, ctx);
-#endif
-    
-    return pMsg->handle;
+    return get_timer_wheel(ctx).add(new Timer(std::forward<CB>(callback)), time, persist != 0);
 }
 /** Cancels a previously set timeout with setTimeout()
  * @return \c false if the handle is not valid. This can happen if the timeout
@@ -143,42 +395,8 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
  */
 static inline bool cancelTimeout(megaHandle handle, void *ctx)
 {
-    timerMutex.lock();
-
     assert(handle);
-    TimerMsg* timer = static_cast<TimerMsg*>(services_hstore_get_handle(MEGA_HTYPE_TIMER, handle));
-    if (!timer)
-    {
-        timerMutex.unlock();
-        return false; //not valid anymore
-    }
-
-//we have to make sure that we delete the timer only after all possibly queued
-//timer messages in the app's message queue are processed. For this purpose,
-//we first stop the timer, and only then post a call to delete the timer.
-//That call should be processed after all timer messages
-    timer->canceled = true; //disable timer callback being called by possibly queued messages, and message freeing in one-shot timer handler
-
-    timerMutex.unlock();
-
-#ifndef USE_LIBWEBSOCKETS
-    event_del(timer->timerEvent); //only removed from message loop, doesn't delete the event struct
-#endif
-    
-    marshallCall([timer, ctx]()
-    {
-#ifdef USE_LIBWEBSOCKETS
-        uv_timer_stop(timer->timerEvent);
-
-        marshallCall([timer, ctx]()
-        {
-            delete timer;
-        }, ctx);
-#else
-        delete timer;   //also deletes the timerEvent
-#endif
-    }, ctx);
-    return true;
+    return get_timer_wheel(ctx).cancel(handle);
 }
 /** @brief Cancels a previously set timer with setInterval.
  * @return \c false if the handle is not valid.
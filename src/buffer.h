@@ -155,17 +155,76 @@ class Buffer: public StaticBuffer
 {
 protected:
     size_t mBufSize;
+    /** Optional storage provided by a derived class, used instead of a heap
+     * block as long as the data fits in it. \c nullptr if there is none.
+     */
+    char* mInlineBuf = nullptr;
+    size_t mInlineSize = 0;
     enum {kMinBufSize = 64};
+    /** @brief Resets the buffer to empty, pointing to the inline storage if
+     * there is one. Does not free the current block
+     */
     void zero()
     {
-        mBuf = nullptr;
-        mBufSize = 0;
+        mBuf = mInlineBuf;
+        mBufSize = mInlineBuf ? mInlineSize : 0;
         mDataSize = 0;
     }
+    /** @brief Frees the current block, if it was allocated on the heap */
+    void freeHeapBuf()
+    {
+        if (mBuf && (mBuf != mInlineBuf))
+            ::free(mBuf);
+    }
+    /** @brief Constructs an empty buffer that uses the provided storage for data
+     * that fits in it. The storage must outlive the buffer, i.e. be a member
+     * of the derived class
+     */
+    enum InlineTag { kInline };
+    Buffer(char* inlineBuf, size_t inlineSize, InlineTag)
+    : mInlineBuf(inlineBuf), mInlineSize(inlineSize)
+    {
+        zero();
+    }
+    /** @brief Ensures the buffer capacity is at least \c reqdSize. The capacity
+     * is at least doubled on each reallocation, to avoid quadratic copying when
+     * a buffer is built by many small appends
+     */
+    void growTo(size_t reqdSize)
+    {
+        if (reqdSize <= mBufSize)
+            return;
+        size_t newsize = (mBufSize > kMinBufSize) ? mBufSize*2 : kMinBufSize;
+        if (newsize < reqdSize)
+            newsize = reqdSize;
+        if (isInline())
+        {
+            char* newbuf = (char*)::malloc(newsize);
+            if (!newbuf)
+                throw std::runtime_error("Buffer::growTo: error allocating block of size "+std::to_string(newsize));
+            memcpy(newbuf, mBuf, mDataSize);
+            mBuf = newbuf;
+            mBufSize = newsize;
+            return;
+        }
+        char* newbuf = (char*)::realloc(mBuf, newsize);
+        if (!newbuf)
+        {
+            //retry with the exact size before giving up
+            newsize = reqdSize;
+            newbuf = (char*)::realloc(mBuf, newsize);
+            if (!newbuf)
+                throw std::runtime_error("Buffer::growTo: error reallocating block of size "+std::to_string(reqdSize));
+        }
+        mBuf = newbuf;
+        mBufSize = newsize;
+    }
 public:
     char* buf() { return mBuf;}
     const char* buf() const { return mBuf;}
     size_t bufSize() const { return mBufSize;}
+    /** @brief Whether the data is currently stored in the inline storage of the object */
+    bool isInline() const { return mBuf && (mBuf == mInlineBuf); }
     Buffer(size_t size=kMinBufSize)
     {
         if (size)
@@ -199,7 +258,17 @@ public:
         }
     }
     Buffer(Buffer&& other)
-        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize) { other.zero(); }
+        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize)
+    {
+        if (other.isInline())
+        {
+            // We can't take the inline storage of \c other, copy the data
+            zero();
+            if (other.mDataSize)
+                assign(other.mBuf, other.mDataSize);
+        }
+        other.zero();
+    }
 
     template <bool withNull>
     Buffer(const std::string& src)
@@ -219,7 +288,7 @@ public:
                 mDataSize = datalen;
                 return;
             }
-            ::free(mBuf);
+            freeHeapBuf();
         }
         mBufSize = (kMinBufSize>datalen) ? kMinBufSize : datalen;
         mBuf = (char*)malloc(mBufSize);
@@ -234,28 +303,55 @@ public:
     template <bool withNull>
     void assign(const std::string& src) { assign(src.c_str(), withNull?(src.size()+1):src.size()); }
     void copyFrom(const StaticBuffer& src) { assign(src.buf(), src.dataSize()); }
+    /** @brief Makes room for at least \c size more bytes after the current data.
+     * An empty buffer allocates exactly \c size bytes, otherwise the capacity
+     * grows geometrically, so that a sequence of reserve()/append() calls
+     * is amortized O(1) per byte
+     */
     void reserve(size_t size)
     {
         if (!mBuf)
         {
+            assert(mDataSize == 0);
             mBuf = (char*)::malloc(size);
+            if (!mBuf)
+            {
+                zero();
+                throw std::runtime_error("Buffer::reserve: Out of memory allocating block of size "+std::to_string(size));
+            }
             mBufSize = size;
-            assert(mDataSize == 0);
         }
         else
         {
-            size_t newsize = mDataSize+size;
-            if (newsize <= mBufSize)
-                return;
-            char* save = mBuf;
-            mBuf = (char*)::realloc(mBuf, newsize);
-            if (!mBuf)
-            {
-                mBuf = save;
-                throw std::runtime_error("Buffer::reserve: Out of memory");
-            }
-            mBufSize = newsize;
+            growTo(mDataSize+size);
+        }
+    }
+    /** @brief Releases the unused capacity. Meant for buffers that are
+     * kept around for a long time after they have been built, i.e. messages
+     * in the history buffer
+     */
+    void shrinkToFit()
+    {
+        if (!mBuf || isInline() || mBufSize == mDataSize)
+            return;
+        if (!mDataSize)
+        {
+            free();
+            return;
+        }
+        if (mInlineBuf && mDataSize <= mInlineSize)
+        {
+            memcpy(mInlineBuf, mBuf, mDataSize);
+            ::free(mBuf);
+            mBuf = mInlineBuf;
+            mBufSize = mInlineSize;
+            return;
         }
+        char* newbuf = (char*)::realloc(mBuf, mDataSize);
+        if (!newbuf) //the old block is still valid, just keep it
+            return;
+        mBuf = newbuf;
+        mBufSize = mDataSize;
     }
     void setDataSize(size_t size)
     {
@@ -268,7 +364,7 @@ public:
         auto reqdSize = offset+dataLen;
         if (reqdSize > mBufSize)
         {
-            reserve(reqdSize);
+            growTo(reqdSize);
             mDataSize = reqdSize;
         }
         else if (reqdSize > mDataSize)
@@ -280,8 +376,25 @@ public:
     char* appendPtr(size_t dataLen) { return writePtr(mDataSize, dataLen); }
     void takeFrom(Buffer&& other)
     {
-        if (mBuf)
-            ::free(mBuf);
+        // Data that fits in our inline storage is copied there. Inline data
+        // of \c other must be copied anyway, as it can't be transferred
+        if (mInlineBuf && other.mDataSize <= mInlineSize)
+        {
+            freeHeapBuf();
+            zero();
+            if (other.mDataSize)
+                memcpy(mBuf, other.mBuf, other.mDataSize);
+            mDataSize = other.mDataSize;
+            other.free();
+            return;
+        }
+        if (other.isInline())
+        {
+            assign(other.mBuf, other.mDataSize);
+            other.free();
+            return;
+        }
+        freeHeapBuf();
         mBuf = other.mBuf;
         mBufSize = other.mBufSize;
         mDataSize = other.mDataSize;
@@ -304,16 +417,7 @@ public:
         else
         {
             if (reqdSize > mBufSize)
-            {
-                auto save = mBuf;
-                mBuf = (char*)::realloc(mBuf, reqdSize);
-                if (!mBuf)
-                {
-                    mBuf = save;
-                    throw std::runtime_error("Buffer::write: error reallocating block of size "+std::to_string(reqdSize));
-                }
-                mBufSize = reqdSize;
-            }
+                growTo(reqdSize);
             memcpy(mBuf+offset, data, datalen);
             mDataSize = reqdSize;
         }
@@ -344,15 +448,13 @@ public:
     {
         if (!mBuf)
             return;
-        ::free(mBuf);
-        mBuf = nullptr;
-        mBufSize = mDataSize = 0;
+        freeHeapBuf();
+        zero();
     }
 
     ~Buffer()
     {
-        if (mBuf)
-            ::free(mBuf);
+        freeHeapBuf();
     }
 };
 #endif
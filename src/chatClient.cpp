@@ -348,7 +348,7 @@ promise::Promise<void> Client::initWithNewSession(const char* sid, const std::st
     mMyEmail = getMyEmailFromSdk();
     db.query("insert or replace into vars(name,value) values('my_email', ?)", mMyEmail);
 
-    mUserAttrCache.reset(new UserAttrCache(*this));
+    mUserAttrCache.reset(new UserAttrCache(*this, mLazyUserAttrCache));
 
     auto wptr = weakHandle();
     return loadOwnKeysFromApi()
@@ -358,6 +358,7 @@ promise::Promise<void> Client::initWithNewSession(const char* sid, const std::st
             return;
         loadContactListFromApi(*contactList);
         chatd.reset(new chatd::Client(this, mMyHandle));
+        chatd->setRamHistoryBudget(mRamHistoryBudget);
         assert(chats->empty());
         chats->onChatsUpdate(*chatList);
         commit(scsn);
@@ -454,7 +455,7 @@ void Client::initWithDbSession(const char* sid)
         }
         assert(db);
         assert(!mSid.empty());
-        mUserAttrCache.reset(new UserAttrCache(*this));
+        mUserAttrCache.reset(new UserAttrCache(*this, mLazyUserAttrCache));
 
         mMyHandle = getMyHandleFromDb();
         assert(mMyHandle);
@@ -474,6 +475,7 @@ void Client::initWithDbSession(const char* sid)
         contactList->loadFromDb();
         mContactsLoaded = true;
         chatd.reset(new chatd::Client(this, mMyHandle));
+        chatd->setRamHistoryBudget(mRamHistoryBudget);
         chats->loadFromDb();
     }
     catch(std::runtime_error& e)
@@ -1117,6 +1119,7 @@ void Client::terminate(bool deleteDb)
 
     disconnect();
     mUserAttrCache.reset();
+    mSymmKeyCache.reset();
 
     if (deleteDb && !mSid.empty())
     {
@@ -1164,6 +1167,10 @@ void Client::onUsersUpdate(mega::MegaApi* api, mega::MegaUserList *aUsers)
                 if (user.isOwnChange() == 0)
                 {
                     mUserAttrCache->onUserAttrChange(user);
+                    if (mSymmKeyCache && (user.getChanges() & mega::MegaUser::CHANGE_TYPE_PUBKEY_CU255))
+                    {
+                        mSymmKeyCache->remove(user.getHandle());
+                    }
                 }
             }
             else
@@ -1237,9 +1244,32 @@ ApiPromise ChatRoom::requestRevokeAccess(mega::MegaNode *node, mega::MegaHandle
 
 strongvelope::ProtocolHandler* Client::newStrongvelope(karere::Id chatid)
 {
-    return new strongvelope::ProtocolHandler(mMyHandle,
+    auto crypto = new strongvelope::ProtocolHandler(mMyHandle,
         StaticBuffer(mMyPrivCu25519, 32), StaticBuffer(mMyPrivEd25519, 32),
         StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, db, chatid, appCtx);
+    crypto->setDecryptPool(mDecryptPool);
+    if (!mSymmKeyCache)
+    {
+        mSymmKeyCache = std::make_shared<strongvelope::SymmKeyCache>(
+            mPersistSymmKeys ? &db : nullptr, StaticBuffer(mMyPrivCu25519, 32));
+    }
+    crypto->setSymmKeyCache(mSymmKeyCache);
+    return crypto;
+}
+
+void Client::setDecryptThreads(unsigned count)
+{
+    if (count)
+        mDecryptPool = std::make_shared<strongvelope::DecryptPool>(count);
+    else
+        mDecryptPool.reset();
+}
+
+void Client::setRamHistoryBudget(size_t bytes)
+{
+    mRamHistoryBudget = bytes;
+    if (chatd)
+        chatd->setRamHistoryBudget(bytes);
 }
 
 void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers)
@@ -2152,6 +2182,8 @@ void ChatRoom::setAppChatHandler(IApp::IChatHandler* handler)
 // calling init(). This is safe, as and we will not get any async events before we
 //return to the event loop
     mChat->setListener(mAppChatHandler);
+    // the app may keep references to the messages while the chat is open
+    mChat->setHistoryEvictable(false);
     mAppChatHandler->init(*mChat, dummyIntf);
 }
 
@@ -2161,6 +2193,7 @@ void ChatRoom::removeAppChatHandler()
         return;
     mAppChatHandler = nullptr;
     mChat->setListener(this);
+    mChat->setHistoryEvictable(true);
 }
 
 void GroupChatRoom::onUserJoin(Id userid, chatd::Priv privilege)
@@ -20,7 +20,7 @@ namespace strophe { class Connection; }
 
 namespace mega { class MegaTextChat; class MegaTextChatList; }
 
-namespace strongvelope { class ProtocolHandler; }
+namespace strongvelope { class ProtocolHandler; class DecryptPool; class SymmKeyCache; }
 
 struct sqlite3;
 class Buffer;
@@ -794,6 +794,33 @@ public:
 
     void commit();  // forces a commit
 
+    /** @brief Sets the number of worker threads that verify signatures of and
+     * decrypt received messages, once their keys are available. Applies to the
+     * chatrooms that are created afterwards, so it should be called before
+     * \c init(). 0 (the default) means that messages are decrypted on the
+     * karere thread
+     */
+    void setDecryptThreads(unsigned count);
+
+    /** @brief Enables persisting the pairwise keys shared with other users in
+     * the local database, encrypted with a key derived from our private Cu25519
+     * key, so that they are not recomputed after a restart. Should be called
+     * before \c init(). The keys are always shared by all chatrooms in memory.
+     */
+    void setPersistSymmKeys(bool enable) { mPersistSymmKeys = enable; }
+
+    /** @brief If enabled (the default), only user names and emails are loaded
+     * from the user attribute cache in the db at startup, and the other
+     * attributes are loaded when requested. Should be called before \c init()
+     */
+    void setLazyUserAttrCache(bool lazy) { mLazyUserAttrCache = lazy; }
+
+    /** @brief Sets the memory budget for the RAM history buffers of all chats,
+     * in bytes, see \c chatd::Client::setRamHistoryBudget(). Can be called at
+     * any time, the value is kept across re-creations of the chatd client
+     */
+    void setRamHistoryBudget(size_t bytes);
+
 /** @cond PRIVATE */
     void dumpChatrooms(::mega::MegaTextChatList& chatRooms);
     void dumpContactList(::mega::MegaUserList& clist);
@@ -812,6 +839,11 @@ protected:
     std::string mPresencedUrl;
     UserAttrCache::Handle mOwnNameAttrHandle;
     megaHandle mHeartbeatTimer = 0;
+    std::shared_ptr<strongvelope::DecryptPool> mDecryptPool;
+    std::shared_ptr<strongvelope::SymmKeyCache> mSymmKeyCache;
+    bool mPersistSymmKeys = false;
+    bool mLazyUserAttrCache = true;
+    size_t mRamHistoryBudget = chatd::Client::kDefaultRamHistoryBudget;
     std::string mLastScsn;
     void heartbeat();
     InitState mInitState = kInitCreated;
@@ -154,6 +154,29 @@ bool Client::isMessageReceivedConfirmationActive() const
     return mMessageReceivedConfirmation;
 }
 
+void Client::setRamHistoryBudget(size_t bytes)
+{
+    mRamHistoryBudget = bytes;
+    evictHistory();
+}
+
+void Client::evictHistory()
+{
+    if (!mRamHistoryBudget || mRamHistoryBytes <= mRamHistoryBudget)
+        return;
+
+    auto before = mRamHistoryBytes;
+    // start from the least recently used chat
+    for (auto it = mHistoryLru.rbegin(); it != mHistoryLru.rend(); it++)
+    {
+        (*it)->evictOldHistory(mRamHistoryBytes - mRamHistoryBudget);
+        if (mRamHistoryBytes <= mRamHistoryBudget)
+            break;
+    }
+    CHATD_LOG_DEBUG("RAM history eviction: %zu -> %zu bytes (budget: %zu)",
+        before, mRamHistoryBytes, mRamHistoryBudget);
+}
+
 void Chat::connect()
 {
     // attempt a connection ONLY if this is a new shard.
@@ -211,6 +234,7 @@ void Chat::disconnect()
 
 void Chat::login()
 {
+    flushHistoryToDb();
     ChatDbInfo info;
     mDbInterface->getHistoryInfo(info);
     mOldestKnownMsgId = info.oldestDbId;
@@ -562,6 +586,7 @@ void Chat::onJoinRejected()
 
 void Chat::onDisconnect()
 {
+    flushHistoryToDb();
     if (mServerOldHistCbEnabled && (mServerFetchState & kHistFetchingOldFromServer))
     {
         //app has been receiving old history from server, but we are now
@@ -575,6 +600,7 @@ void Chat::onDisconnect()
 
 HistSource Chat::getHistory(unsigned count)
 {
+    touchHistory();
     if (isNotifyingOldHistFromServer())
     {
         return kHistSourceServer;
@@ -687,6 +713,7 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
       mListener(listener), mUsers(initialUsers), mCrypto(crypto),
       mLastMsgTs(chatCreationTs), mIsGroup(isGroup)
 {
+    mHistoryLruPos = mClient.mHistoryLru.insert(mClient.mHistoryLru.begin(), this);
     assert(mChatId);
     assert(mListener);
     assert(mCrypto);
@@ -703,6 +730,8 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     mLastReceivedId = info.lastRecvId;
     mLastSeenIdx = mDbInterface->getIdxOfMsgid(mLastSeenId);
     mLastReceivedIdx = mDbInterface->getIdxOfMsgid(mLastReceivedId);
+    mUnreadCount = info.unreadCount;
+    mUnreadCountValid = info.hasUnreadCount;
 
     if ((mHaveAllHistory = mDbInterface->haveAllHistory()))
     {
@@ -735,7 +764,15 @@ Chat::~Chat()
     catch(std::exception& e)
     { CHATID_LOG_ERROR("EXCEPTION from ICrypto destructor: %s", e.what()); }
     mCrypto = nullptr;
+    for (auto& item: mSending)
+    {
+        if (item.opcode() == OP_NEWMSG)
+            mClient.mChatForMsgxid.erase(item.msg->id());
+    }
+    flushHistoryToDb();
     clear();
+    mClient.mRamHistoryBytes -= mRamHistoryBytes;
+    mClient.mHistoryLru.erase(mHistoryLruPos);
     try { delete mDbInterface; }
     catch(std::exception& e)
     { CHATID_LOG_ERROR("EXCEPTION from DbInterface destructor: %s", e.what()); }
@@ -856,9 +893,9 @@ void Connection::execCommand(const StaticBuffer& buf)
                     ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(msgid),
                     ID_CSTR(userid), keyid);
 
-                std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
-                msg->setEncrypted(1);
                 Chat& chat = mClient.chats(chatid);
+                std::unique_ptr<Message> msg(new (chat.msgPool()) Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
+                msg->setEncrypted(1);
                 if (opcode == OP_MSGUPD)
                 {
                     chat.onMsgUpdated(msg.release());
@@ -1034,6 +1071,7 @@ void Chat::onHistDone()
 void Chat::onFetchHistDone()
 {
     assert(isFetchingFromServer());
+    flushHistoryToDb();
 
     //resetHistFetch() may have been called while fetching from server,
     //so state may be fetching-from-ram or fetching-from-db
@@ -1079,7 +1117,10 @@ void Chat::onFetchHistDone()
             CALL_LISTENER(onHistoryDone, kHistSourceServer);
         }
         if (mLastSeenIdx == CHATD_IDX_INVALID)
+        {
+            invalidateUnreadCount();
             CALL_LISTENER(onUnreadChanged);
+        }
     }
 
     // handle last text message fetching
@@ -1097,6 +1138,10 @@ void Chat::loadAndProcessUnsent()
     CALL_DB(loadSendQueue, mSending);
     if (mSending.empty())
         return;
+    for (auto it = mSending.begin(); it != mSending.end(); it++)
+    {
+        addToSendingIndex(it);
+    }
     mNextUnsent = mSending.begin();
     replayUnsentNotifications();
 
@@ -1186,18 +1231,56 @@ bool Chat::isGroup() const
 
 Message* Chat::getMsgByXid(Id msgxid)
 {
-    for (auto& item: mSending)
+    auto it = mSendingIdxForXid.find(msgxid);
+    if (it == mSendingIdxForXid.end())
+        return nullptr;
+    auto& item = *it->second.first;
+    assert(item.msg && item.msg->isSending());
+    return item.msg;
+}
+
+void Chat::addToSendingIndex(OutputQueue::iterator it)
+{
+    //id() of MSGUPD messages is a real msgid, not a msgxid
+    if (it->opcode() == OP_MSGUPD)
+        return;
+    auto msgxid = it->msg->id();
+    auto ret = mSendingIdxForXid.emplace(msgxid, SendingIdxEntry{it, 1});
+    if (!ret.second) //there is already an item with this msgxid, earlier in the queue
+        ret.first->second.count++;
+    if (it->opcode() == OP_NEWMSG)
+        mClient.mChatForMsgxid[msgxid] = this;
+}
+
+void Chat::removeFromSendingIndex(OutputQueue::iterator it)
+{
+    if (it->opcode() == OP_MSGUPD)
+        return;
+    auto msgxid = it->msg->id();
+    if (it->opcode() == OP_NEWMSG)
+        mClient.mChatForMsgxid.erase(msgxid);
+    auto idxit = mSendingIdxForXid.find(msgxid);
+    if (idxit == mSendingIdxForXid.end())
+        return;
+    auto& entry = idxit->second;
+    if (--entry.count == 0)
     {
-        if (!item.msg)
-            continue;
-        //id() of MSGUPD messages is a real msgid, not a msgxid
-        if ((item.msg->id() == msgxid) && (item.opcode() != OP_MSGUPD))
+        mSendingIdxForXid.erase(idxit);
+        return;
+    }
+    if (entry.first != it)
+        return;
+    //point the index to the next item with that msgxid (i.e. a MSGUPDX)
+    for (auto next = std::next(it); next != mSending.end(); next++)
+    {
+        if ((next->opcode() != OP_MSGUPD) && (next->msg->id() == msgxid))
         {
-            assert(item.msg->isSending());
-            return item.msg;
+            entry.first = next;
+            return;
         }
     }
-    return nullptr;
+    assert(false);
+    mSendingIdxForXid.erase(idxit);
 }
 
 bool Chat::haveAllHistoryNotified() const
@@ -1218,8 +1301,9 @@ uint64_t Chat::generateRefId(const ICrypto* aCrypto)
 
 Message* Chat::msgSubmit(const char* msg, size_t msglen, unsigned char type, void* userp)
 {
+    touchHistory();
     // write the new message to the message buffer and mark as in sending state
-    auto message = new Message(makeRandomId(), client().userId(), time(NULL),
+    auto message = new (mMsgPool) Message(makeRandomId(), client().userId(), time(NULL),
         0, msg, msglen, true, CHATD_KEYID_INVALID, type, userp);
     message->backRefId = generateRefId(mCrypto);
 
@@ -1291,6 +1375,7 @@ void Chat::createMsgBackRefs(Message& msg)
 Chat::SendingItem* Chat::postMsgToSending(uint8_t opcode, Message* msg)
 {
     mSending.emplace_back(opcode, msg, mUsers);
+    addToSendingIndex(std::prev(mSending.end()));
     CALL_DB(saveMsgToSending, mSending.back());
     if (mNextUnsent == mSending.end())
     {
@@ -1489,7 +1574,11 @@ void Chat::onLastSeen(Id msgid)
             {
                 CHATD_LOG_WARNING("onLastSeen: Setting last seen index to an older message");
             }
-            mLastSeenIdx = idx;
+            if (idx != mLastSeenIdx)
+            {
+                mLastSeenIdx = idx;
+                invalidateUnreadCount();
+            }
         }
     }
     else
@@ -1497,6 +1586,7 @@ void Chat::onLastSeen(Id msgid)
         auto idx = it->second;
         if (idx == mLastSeenIdx)
             return; //we may have set it from db already
+        Idx prevIdx = mLastSeenIdx;
         if(at(idx).userid == mClient.mUserId)
         {
             CHATD_LOG_WARNING("Last-seen points to a message by us, possibly the pointer was not set properly");
@@ -1523,6 +1613,7 @@ void Chat::onLastSeen(Id msgid)
             mLastSeenIdx = idx;
             notifyOldest = lownum();
         }
+        onLastSeenIdxChanged(prevIdx);
         for (Idx i=notifyOldest; i<=mLastSeenIdx; i++)
         {
             auto& msg = at(i);
@@ -1568,7 +1659,9 @@ bool Chat::setMessageSeen(Idx idx)
             Idx lowest = lownum()-1;
             notifyStart = (mLastSeenIdx < lowest) ? lowest : mLastSeenIdx;
         }
+        Idx prevIdx = mLastSeenIdx;
         mLastSeenIdx = idx;
+        onLastSeenIdxChanged(prevIdx);
         Idx highest = highnum();
         Idx notifyEnd = (mLastSeenIdx > highest) ? highest : mLastSeenIdx;
 
@@ -1600,6 +1693,62 @@ bool Chat::setMessageSeen(Id msgid)
 }
 
 int Chat::unreadMsgCount() const
+{
+    if (!mUnreadCountValid)
+    {
+        mUnreadCount = calculateUnreadCount();
+        mUnreadCountValid = true;
+        CALL_DB(setUnreadCount, mUnreadCount);
+    }
+    return mUnreadCount;
+}
+
+void Chat::adjustUnreadCount(int delta)
+{
+    if (!mUnreadCountValid)
+        return;
+    mUnreadCount += delta;
+    CALL_DB(setUnreadCount, mUnreadCount);
+}
+
+void Chat::invalidateUnreadCount()
+{
+    if (!mUnreadCountValid)
+        return;
+    mUnreadCountValid = false;
+    CALL_DB(clearUnreadCount);
+}
+
+void Chat::onLastSeenIdxChanged(Idx prevIdx)
+{
+    if (!mUnreadCountValid)
+        return;
+    // We can only subtract the messages that became seen if they are all in
+    // RAM, and the count doesn't include messages before the last-seen pointer
+    if ((prevIdx == CHATD_IDX_INVALID) || (mLastSeenIdx == CHATD_IDX_INVALID)
+     || (mLastSeenIdx < prevIdx) || (prevIdx + 1 < lownum()) || (mLastSeenIdx > highnum()))
+    {
+        invalidateUnreadCount();
+        return;
+    }
+    int seen = 0;
+    for (Idx i = prevIdx + 1; i <= mLastSeenIdx; i++)
+    {
+        // messages still pending decryption haven't been counted yet, and
+        // won't be once decrypted, since they are already seen
+        auto& msg = at(i);
+        if ((msg.isEncrypted() != 1) && isUnreadCandidate(msg))
+        {
+            seen++;
+        }
+    }
+    if (seen)
+    {
+        adjustUnreadCount(-seen);
+    }
+}
+
+int Chat::calculateUnreadCount() const
 {
     if (mLastSeenIdx == CHATD_IDX_INVALID)
     {
@@ -1611,12 +1760,14 @@ int Chat::unreadMsgCount() const
         }
         else
         {
-            return -mDbInterface->getPeerMsgCountAfterIdx(CHATD_IDX_INVALID);
+            return -(mDbInterface->getPeerMsgCountAfterIdx(CHATD_IDX_INVALID)
+                     + pendingHistUnreadCount(CHATD_IDX_INVALID));
         }
     }
     else if (mLastSeenIdx < lownum())
     {
-        return mDbInterface->getPeerMsgCountAfterIdx(mLastSeenIdx);
+        return mDbInterface->getPeerMsgCountAfterIdx(mLastSeenIdx)
+                + pendingHistUnreadCount(mLastSeenIdx);
     }
 
     Idx first = mLastSeenIdx+1;
@@ -1624,12 +1775,9 @@ int Chat::unreadMsgCount() const
     auto last = highnum();
     for (Idx i=first; i<=last; i++)
     {
-        // conditions to consider unread messages should match the
-        // ones in ChatdSqliteDb::getPeerMsgCountAfterIdx()
+        // messages still pending decryption are counted when they get decrypted
         auto& msg = at(i);
-        if (msg.userid != mClient.userId()               // skip own messages
-                && !(msg.updated && !msg.size())         // skip deleted messages
-                && (msg.type != Message::kMsgRevokeAttachment))  // skip revoke messages
+        if ((msg.isEncrypted() != 1) && isUnreadCandidate(msg))
         {
             count++;
         }
@@ -1637,6 +1785,52 @@ int Chat::unreadMsgCount() const
     return count;
 }
 
+bool Chat::isUnreadCandidate(const Message& msg) const
+{
+    // conditions to consider unread messages should match the
+    // ones in ChatdSqliteDb::getPeerMsgCountAfterIdx()
+    return (msg.userid != mClient.userId()                  // skip own messages
+            && !(msg.updated && !msg.size())                // skip deleted messages
+            && (msg.type != Message::kMsgRevokeAttachment)); // skip revoke messages
+}
+
+// Messages that are not yet written to the db are not seen by
+// DbInterface::getPeerMsgCountAfterIdx(), so count them separately
+unsigned Chat::pendingHistUnreadCount(Idx after) const
+{
+    unsigned count = 0;
+    for (auto idx: mPendingHistDbWrites)
+    {
+        if ((after != CHATD_IDX_INVALID) && (idx <= after))
+            continue;
+        auto msg = findOrNull(idx);
+        if (msg && isUnreadCandidate(*msg))
+            count++;
+    }
+    return count;
+}
+
+void Chat::flushHistoryToDb()
+{
+    if (mPendingHistDbWrites.empty())
+        return;
+
+    HistoryBatch batch;
+    batch.reserve(mPendingHistDbWrites.size());
+    for (auto idx: mPendingHistDbWrites)
+    {
+        auto msg = findOrNull(idx);
+        if (!msg)
+        {
+            CHATID_LOG_ERROR("flushHistoryToDb: Message with idx %d is no longer in RAM, can't write it to db", idx);
+            continue;
+        }
+        batch.emplace_back(msg, idx);
+    }
+    mPendingHistDbWrites.clear();
+    CALL_DB(addMsgsToHistory, batch);
+}
+
 void Chat::flushOutputQueue(bool fromStart)
 {
 //We assume that if fromStart is set, then we have to set mIgnoreKeyAcks
@@ -1689,6 +1883,8 @@ void Chat::moveItemToManualSending(OutputQueue::iterator it, ManualSendReason re
 {
     CALL_DB(deleteItemFromSending, it->rowid);
     CALL_DB(saveItemToManualSending, *it, reason);
+    //the listener takes ownership of the message and may delete it, so unindex it before
+    removeFromSendingIndex(it);
     CALL_LISTENER(onManualSendRequired, it->msg, it->rowid, reason); //GUI should put this message at end of that list of messages requiring 'manual' resend
     it->msg = nullptr; //don't delete the Message object, it will be owned by the app
     mSending.erase(it);
@@ -1716,7 +1912,17 @@ void Chat::joinRangeHist(const ChatDbInfo& dbInfo)
 
 void Client::msgConfirm(Id msgxid, Id msgid)
 {
-    // TODO: maybe it's more efficient to keep a separate mapping of msgxid to messages?
+    auto it = mChatForMsgxid.find(msgxid);
+    if (it != mChatForMsgxid.end())
+    {
+        it->second->msgConfirm(msgxid, msgid);
+        // the item is removed from the index when it's removed from the send queue,
+        // either confirmed or moved to manual sending
+        if (mChatForMsgxid.find(msgxid) == mChatForMsgxid.end())
+            return;
+    }
+    // Not a new message that we know of (i.e. a MSGUPD at the front of the
+    // send queue), fall back to asking all chats
     for (auto& chat: mChatForChatId)
     {
         if (chat.second->msgConfirm(msgxid, msgid) != CHATD_IDX_INVALID)
@@ -1728,6 +1934,10 @@ void Client::msgConfirm(Id msgxid, Id msgid)
 //called when MSGID is received
 bool Client::onMsgAlreadySent(Id msgxid, Id msgid)
 {
+    auto it = mChatForMsgxid.find(msgxid);
+    if ((it != mChatForMsgxid.end()) && it->second->msgAlreadySent(msgxid, msgid))
+        return true;
+
     for (auto& chat: mChatForChatId)
     {
         if (chat.second->msgAlreadySent(msgxid, msgid))
@@ -1778,6 +1988,7 @@ Message* Chat::msgRemoveFromSending(Id msgxid, Id msgid)
             : kManualSendGeneralReject); //deletes item
         return nullptr;
     }
+    removeFromSendingIndex(mSending.begin());
     auto msg = item.msg;
     item.msg = nullptr;
     assert(msg);
@@ -1820,6 +2031,8 @@ Idx Chat::msgConfirm(Id msgxid, Id msgid)
             item.setOpcode(OP_MSGUPD);
         }
     }
+    //all remaining items with that msgxid are now MSGUPDs
+    mSendingIdxForXid.erase(msgxid);
     CALL_LISTENER(onMessageConfirmed, msgxid, *msg, idx);
 
     // last text message stuff
@@ -1900,6 +2113,7 @@ void Chat::rejectMsgupd(Id id, uint8_t serverReason)
     {
         CALL_LISTENER(onEditRejected, msg, kManualSendEditNoChange);
         CALL_DB(deleteItemFromSending, mSending.front().rowid);
+        removeFromSendingIndex(mSending.begin());
         mSending.pop_front();
     }
     else
@@ -1924,6 +2138,7 @@ void Chat::rejectGeneric(uint8_t opcode)
         throw std::runtime_error("rejectGeneric(mustBeInSending): Rejected command is not at the front of the send queue");
     }
     CALL_DB(deleteItemFromSending, mSending.front().rowid);
+    removeFromSendingIndex(mSending.begin());
     mSending.pop_front();
 }
 
@@ -1948,6 +2163,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             auto erased = it;
             it++;
             mPendingEdits.erase(cipherMsg->id());
+            removeFromSendingIndex(erased);
             mSending.erase(erased);
         }
     }
@@ -1956,6 +2172,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
     {
         assert(!msg->isEncrypted());
         //update in db
+        flushHistoryToDb(); //the edited message may not be written yet
         CALL_DB(updateMsgInHistory, msg->id(), *msg);
         //update in memory, if loaded
         auto msgit = mIdToIndexMap.find(msg->id());
@@ -1966,10 +2183,21 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             idx = msgit->second;
             auto& histmsg = at(idx);
             prevType = histmsg.type;
+            bool wasUnread = isUnreadCandidate(histmsg);
             histmsg.takeFrom(std::move(*msg));
             histmsg.updated = msg->updated;
             histmsg.type = msg->type;
             histmsg.userid = msg->userid;
+            if (mLastSeenIdx == CHATD_IDX_INVALID)
+            {
+                invalidateUnreadCount();
+            }
+            else if (idx > mLastSeenIdx)
+            {
+                int delta = (int)isUnreadCandidate(histmsg) - (int)wasUnread;
+                if (delta)
+                    adjustUnreadCount(delta);
+            }
 
             if (idx > mNextHistFetchIdx)
             {
@@ -2005,6 +2233,12 @@ void Chat::onMsgUpdated(Message* cipherMsg)
         {
             idx = CHATD_IDX_INVALID;
             prevType = Message::kMsgInvalid;
+            // the message may be newer than the last-seen one, if that's
+            // not in RAM either
+            if ((mLastSeenIdx == CHATD_IDX_INVALID) || (mLastSeenIdx < lownum()))
+            {
+                invalidateUnreadCount();
+            }
         }
 
         if (msg->type == Message::kMsgTruncate)
@@ -2040,6 +2274,7 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
 // avoid the whole replay (even the idempotent part), and just bail out.
 
     CHATID_LOG_DEBUG("Truncating chat history before msgid %s, idx %d, fwdStart %d", ID_CSTR(msg.id()), idx, mForwardStart);
+    flushHistoryToDb();
     CALL_DB(truncateHistory, msg);
     if (idx != CHATD_IDX_INVALID)
     {
@@ -2087,6 +2322,7 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
     {
         mHasMoreHistoryInDb = false;
     }
+    invalidateUnreadCount();
     CALL_LISTENER(onUnreadChanged);
     findAndNotifyLastTextMsg();
 }
@@ -2112,6 +2348,129 @@ void Chat::deleteMessagesBefore(Idx idx)
     {
         mBackwardList.erase(mBackwardList.begin()+mForwardStart-idx, mBackwardList.end());
     }
+    mDecryptAhead.erase(mDecryptAhead.begin(), mDecryptAhead.lower_bound(idx));
+    updateRamHistoryBytes();
+}
+
+void Chat::push_forward(Message* msg)
+{
+    mForwardList.emplace_back(msg);
+    onRamHistoryAdded(*msg);
+}
+
+void Chat::push_back(Message* msg)
+{
+    mBackwardList.emplace_back(msg);
+    onRamHistoryAdded(*msg);
+}
+
+size_t Chat::msgRamSize(const Message& msg)
+{
+    size_t size = sizeof(Message);
+    if (!msg.isInline())
+        size += msg.bufSize();
+    if (msg.backRefs.size() > BackRefList::kInlineCount)
+        size += msg.backRefs.size() * sizeof(BackRefId);
+    return size;
+}
+
+void Chat::onRamHistoryAdded(const Message& msg)
+{
+    auto size = msgRamSize(msg);
+    mRamHistoryBytes += size;
+    mClient.mRamHistoryBytes += size;
+    if (mHistoryEvictionScheduled || !mClient.mRamHistoryBudget
+     || (mClient.mRamHistoryBytes <= mClient.mRamHistoryBudget))
+        return;
+
+    // Evict asynchronously, as we may be in the middle of processing messages
+    mHistoryEvictionScheduled = true;
+    auto wptr = weakHandle();
+    marshallCall([wptr, this]()
+    {
+        if (wptr.deleted())
+            return;
+        mHistoryEvictionScheduled = false;
+        mClient.evictHistory();
+    }, mClient.karereClient->appCtx);
+}
+
+void Chat::updateRamHistoryBytes()
+{
+    size_t size = 0;
+    for (auto& msg: mForwardList)
+        size += msgRamSize(*msg);
+    for (auto& msg: mBackwardList)
+        size += msgRamSize(*msg);
+    mClient.mRamHistoryBytes = mClient.mRamHistoryBytes - mRamHistoryBytes + size;
+    mRamHistoryBytes = size;
+}
+
+void Chat::touchHistory()
+{
+    auto& lru = mClient.mHistoryLru;
+    lru.splice(lru.begin(), lru, mHistoryLruPos);
+}
+
+size_t Chat::evictOldHistory(size_t bytesToFree)
+{
+    // Don't evict anything while the history buffer is in a transitional state.
+    // All messages that we evict must be in the db
+    if (!mHistoryEvictable || isFetchingFromServer()
+     || (mDecryptOldHaltedAt != CHATD_IDX_INVALID) || (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
+     || (size() <= kMinRamHistoryMsgs))
+        return 0;
+
+    flushHistoryToDb();
+    Idx low = lownum();
+    Idx end = highnum() - kMinRamHistoryMsgs + 1;
+    if ((mNextHistFetchIdx != CHATD_IDX_INVALID) && (mNextHistFetchIdx + 1 < end))
+    {
+        // don't evict messages that have already been passed to the app
+        // via getHistory(), the next getHistory() will continue below them
+        end = mNextHistFetchIdx + 1;
+    }
+    size_t freed = 0;
+    Idx idx = low;
+    for (; (idx < end) && (freed < bytesToFree); idx++)
+    {
+        auto& msg = at(idx);
+        if (msg.isEncrypted() == 1) //not processed yet, so not in db
+            break;
+        freed += msgRamSize(msg);
+        // msgIndexFromId() looks up the evicted messages in the db
+        mIdToIndexMap.erase(msg.id());
+        if (msg.backRefId)
+            mRefidToIdxMap.erase(msg.backRefId);
+    }
+    if (idx == low)
+        return 0;
+
+    deleteMessagesBefore(idx);
+    mHasMoreHistoryInDb = true;
+    mHasEvictedHistory = true;
+    mClient.mEvictedMsgCount += (idx - low);
+    CHATID_LOG_DEBUG("Evicted %d messages (%zu bytes) from RAM history, %d remain",
+        idx - low, freed, size());
+    return freed;
+}
+
+Idx Chat::msgIndexFromId(Id msgid) const
+{
+    auto it = mIdToIndexMap.find(msgid);
+    if (it != mIdToIndexMap.end())
+        return it->second;
+    if (!mHasEvictedHistory || empty())
+        return CHATD_IDX_INVALID;
+
+    Idx idx = mDbInterface->getIdxOfMsgid(msgid);
+    return (idx < lownum()) ? idx : CHATD_IDX_INVALID;
+}
+
+Message* Chat::loadEvictedMsg(Idx idx)
+{
+    assert(idx < lownum());
+    return mDbInterface->fetchDbMessage(idx);
 }
 
 Message::Status Chat::getMsgStatus(const Message& msg, Idx idx) const
@@ -2180,6 +2539,7 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
             if (mHasMoreHistoryInDb)
             { //we have db history that is not loaded, so we determine the index
               //by the db, and don't add the message to RAM
+                flushHistoryToDb();
                 idx = mDbInterface->getOldestIdx()-1;
             }
             else
@@ -2214,46 +2574,68 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         msgIncomingAfterDecrypt(isNew, true, msg, idx);
         return true;
     }
-    else
-    {
-        assert(msg.isEncrypted() == 1); //no decrypt attempt was made
-    }
 
-    try
+    promise::Promise<Message*> pms;
+    auto ahead = mDecryptAhead.find(idx);
+    if (ahead != mDecryptAhead.end())
     {
-        mCrypto->handleLegacyKeys(msg);
+        // decryption was started in advance by decryptAhead(), the copy of the
+        // message may already be decrypted
+        auto copy = ahead->second.copy;
+        auto message = &msg;
+        pms = ahead->second.pms.then([copy, message](Message*)
+        {
+            message->userid = copy->userid;
+            message->type = copy->type;
+            message->backRefId = copy->backRefId;
+            message->backRefs = copy->backRefs;
+            message->setEncrypted(copy->isEncrypted());
+            message->takeFrom(std::move(*copy));
+            return message;
+        });
+        mDecryptAhead.erase(ahead);
     }
-    catch(std::exception& e)
+    else
     {
-        CHATID_LOG_WARNING("handleLegacyKeys threw error: %s\n"
-            "Queued messages for decrypt: %d - %d. Ignoring", e.what(),
-            mDecryptOldHaltedAt, idx);
-    }
+        assert(msg.isEncrypted() == 1); //no decrypt attempt was made
+        try
+        {
+            mCrypto->handleLegacyKeys(msg);
+        }
+        catch(std::exception& e)
+        {
+            CHATID_LOG_WARNING("handleLegacyKeys threw error: %s\n"
+                "Queued messages for decrypt: %d - %d. Ignoring", e.what(),
+                mDecryptOldHaltedAt, idx);
+        }
 
-    if (at(idx).isEncrypted() != 1)
-    {
-        CHATID_LOG_DEBUG("handleLegacyKeys already decrypted msg %s, bailing out", ID_CSTR(msg.id()));
-        return true;
-    }
+        if (at(idx).isEncrypted() != 1)
+        {
+            CHATID_LOG_DEBUG("handleLegacyKeys already decrypted msg %s, bailing out", ID_CSTR(msg.id()));
+            return true;
+        }
 
-    if (isNew)
-    {
-        if (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
+        if (isNew)
         {
-            CHATID_LOG_DEBUG("Decryption of new messages is halted, message queued for decryption");
-            return false;
+            if (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
+            {
+                CHATID_LOG_DEBUG("Decryption of new messages is halted, message queued for decryption");
+                decryptAhead(true);
+                return false;
+            }
         }
-    }
-    else
-    {
-        if (mDecryptOldHaltedAt != CHATD_IDX_INVALID)
+        else
         {
-            CHATID_LOG_DEBUG("Decryption of old messages is halted, message queued for decryption");
-            return false;
+            if (mDecryptOldHaltedAt != CHATD_IDX_INVALID)
+            {
+                CHATID_LOG_DEBUG("Decryption of old messages is halted, message queued for decryption");
+                decryptAhead(false);
+                return false;
+            }
         }
+        CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt()");
+        pms = mCrypto->msgDecrypt(&msg);
     }
-    CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt()");
-    auto pms = mCrypto->msgDecrypt(&msg);
     if (pms.succeeded())
     {
         assert(!msg.isEncrypted());
@@ -2337,6 +2719,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
             if ((mServerFetchState == kHistDecryptingOld) &&
                 (mDecryptOldHaltedAt == CHATD_IDX_INVALID))
             {
+                flushHistoryToDb();
                 mServerFetchState = kHistNotFetching;
                 if (mServerOldHistCbEnabled)
                 {
@@ -2346,9 +2729,58 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         }
     });
 
+    decryptAhead(isNew);
     return false; //decrypt was not done immediately
 }
 
+void Chat::decryptAhead(bool isNew)
+{
+    Idx halted = isNew ? mDecryptNewHaltedAt : mDecryptOldHaltedAt;
+    if (halted == CHATD_IDX_INVALID) //the delayed decrypt completed synchronously
+        return;
+    auto window = mCrypto->decryptAheadWindow();
+    for (unsigned i = 1; i <= window; i++)
+    {
+        Idx idx = isNew ? halted+i : halted-i;
+        if ((idx > highnum()) || (idx < lownum()))
+            break;
+        if (mDecryptAhead.find(idx) != mDecryptAhead.end())
+            continue;
+        auto& msg = at(idx);
+        if (msg.isEncrypted() != 1)
+            continue;
+        // same as for in-order decryption, so that keys carried by legacy
+        // messages are known before decrypting the messages that follow
+        try
+        {
+            mCrypto->handleLegacyKeys(msg);
+        }
+        catch(std::exception& e)
+        {
+            CHATID_LOG_WARNING("handleLegacyKeys threw error: %s\n"
+                "Message at idx %d will be decrypted ahead anyway", e.what(), idx);
+        }
+        if (msg.isEncrypted() != 1)
+        {
+            CHATID_LOG_DEBUG("handleLegacyKeys already decrypted msg %s", ID_CSTR(msg.id()));
+            continue;
+        }
+        auto copy = std::shared_ptr<Message>(new Message(msg.id(), msg.userid,
+            msg.ts, msg.updated, msg.buf(), msg.dataSize(), msg.isSending(),
+            msg.keyid, msg.type, msg.userp));
+        copy->setEncrypted(1);
+        CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt() in advance");
+        // the continuation keeps the copy alive until the crypto module has
+        // finished writing to it, even if the entry is erased before
+        auto pms = mCrypto->msgDecrypt(copy.get())
+        .then([copy](Message* decrypted)
+        {
+            return decrypted;
+        });
+        mDecryptAhead.emplace(idx, DecryptAheadItem{copy, pms});
+    }
+}
+
 // Save to history db, handle received and seen pointers, call new/old message user callbacks
 void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx)
 {
@@ -2370,7 +2802,15 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
         }
 
         verifyMsgOrder(msg, idx);
-        CALL_DB(addMsgToHistory, msg, idx);
+        if (!isNew && hasNum(idx))
+        {
+            // old history from server - written to db in one batch when the fetch completes
+            mPendingHistDbWrites.push_back(idx);
+        }
+        else
+        {
+            CALL_DB(addMsgToHistory, msg, idx);
+        }
 
 
         if (mClient.isMessageReceivedConfirmationActive() && !isGroup() &&
@@ -2390,6 +2830,16 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
         CALL_LISTENER(onMsgOrderVerificationFail, msg, idx, "A message with that backrefId "+std::to_string(msg.backRefId)+" already exists");
     }
 
+    if (mLastSeenIdx == CHATD_IDX_INVALID)
+    {
+        invalidateUnreadCount();
+    }
+    else if (!isLocal && (idx > mLastSeenIdx) && isUnreadCandidate(msg))
+    {
+        // local messages are already in the db, so they were counted
+        adjustUnreadCount(1);
+    }
+
     auto status = getMsgStatus(msg, idx);
     if (isNew)
     {
@@ -2405,6 +2855,7 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
             CALL_LISTENER(onRecvHistoryMessage, idx, msg, status, isLocal);
         }
     }
+
     if (msg.type == Message::kMsgTruncate)
     {
         if (isNew)
@@ -2751,4 +3202,156 @@ const char* Message::statusNames[] =
 {
   "Sending", "SendingManual", "ServerReceived", "ServerRejected", "Delivered", "NotSeen", "Seen"
 };
+
+struct MessagePool::Slab
+{
+    MessagePool* pool; //nullptr if the pool was destroyed while the slab was still in use
+    Slab* prev;
+    Slab* next;
+    char* freeList; //slots that were released, linked via their first bytes
+    uint32_t used;
+    uint32_t bumpIdx; //slots past this index have never been used
+    char* slot(size_t i) { return reinterpret_cast<char*>(this)+kHeaderSize+i*kSlotSize; }
+
+    static constexpr size_t alignedSize(size_t size)
+    {
+        return (size+sizeof(SlotHeader)-1) / sizeof(SlotHeader) * sizeof(SlotHeader);
+    }
+    static const size_t kHeaderSize;
+    static const size_t kSlotSize;
+    static const size_t kSlabSize;
+};
+const size_t MessagePool::Slab::kHeaderSize = MessagePool::Slab::alignedSize(sizeof(MessagePool::Slab));
+const size_t MessagePool::Slab::kSlotSize = MessagePool::Slab::alignedSize(sizeof(SlotHeader)+sizeof(Message));
+const size_t MessagePool::Slab::kSlabSize = MessagePool::Slab::kHeaderSize+kSlotsPerSlab*MessagePool::Slab::kSlotSize;
+
+MessagePool::~MessagePool()
+{
+    // Messages that are still alive keep their slabs, which are freed when
+    // the last of them is deleted
+    for (Slab* list: {mPartial, mFull})
+    {
+        for (Slab* slab = list; slab; slab = slab->next)
+        {
+            slab->pool = nullptr;
+        }
+    }
+}
+
+void* MessagePool::heapAlloc(size_t size)
+{
+    auto hdr = static_cast<SlotHeader*>(::malloc(sizeof(SlotHeader)+size));
+    if (!hdr)
+        throw std::bad_alloc();
+    hdr->slab = nullptr;
+    return hdr+1;
+}
+
+void* MessagePool::alloc(size_t size)
+{
+    if (size != sizeof(Message))
+        return heapAlloc(size);
+
+    Slab* slab = mPartial ? mPartial : newSlab();
+    char* slot;
+    if (slab->freeList)
+    {
+        slot = slab->freeList;
+        slab->freeList = *reinterpret_cast<char**>(slot);
+    }
+    else
+    {
+        assert(slab->bumpIdx < kSlotsPerSlab);
+        slot = slab->slot(slab->bumpIdx++);
+    }
+    if (++slab->used == kSlotsPerSlab)
+    {
+        unlink(mPartial, slab);
+        pushFront(mFull, slab);
+    }
+    auto hdr = reinterpret_cast<SlotHeader*>(slot);
+    hdr->slab = slab;
+    return hdr+1;
+}
+
+void MessagePool::release(void* ptr)
+{
+    if (!ptr)
+        return;
+    auto hdr = static_cast<SlotHeader*>(ptr)-1;
+    Slab* slab = hdr->slab;
+    if (!slab)
+    {
+        ::free(hdr);
+        return;
+    }
+    auto slot = reinterpret_cast<char*>(hdr);
+    *reinterpret_cast<char**>(slot) = slab->freeList;
+    slab->freeList = slot;
+    MessagePool* pool = slab->pool;
+    if (!pool)
+    {
+        if (--slab->used == 0)
+            ::free(slab);
+        return;
+    }
+    if (slab->used-- == kSlotsPerSlab)
+    {
+        unlink(pool->mFull, slab);
+        pushFront(pool->mPartial, slab);
+    }
+    if (slab->used == 0)
+    {
+        pool->freeSlab(slab);
+    }
+}
+
+size_t MessagePool::allocatedBytes() const
+{
+    return mSlabCount*Slab::kSlabSize;
+}
+
+MessagePool::Slab* MessagePool::newSlab()
+{
+    auto slab = static_cast<Slab*>(::malloc(Slab::kSlabSize));
+    if (!slab)
+        throw std::bad_alloc();
+    slab->pool = this;
+    slab->freeList = nullptr;
+    slab->used = 0;
+    slab->bumpIdx = 0;
+    pushFront(mPartial, slab);
+    mSlabCount++;
+    return slab;
+}
+
+void MessagePool::freeSlab(Slab* slab)
+{
+    assert(slab->used == 0);
+    unlink(mPartial, slab);
+    ::free(slab);
+    mSlabCount--;
+}
+
+void MessagePool::unlink(Slab*& list, Slab* slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+    {
+        assert(list == slab);
+        list = slab->next;
+    }
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+void MessagePool::pushFront(Slab*& list, Slab* slab)
+{
+    slab->prev = nullptr;
+    slab->next = list;
+    if (list)
+        list->prev = slab;
+    list = slab;
+}
 }
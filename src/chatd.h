@@ -5,6 +5,7 @@
 #include <string>
 #include <buffer.h>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <list>
 #include <deque>
@@ -493,12 +494,29 @@ protected:
     std::vector<std::unique_ptr<Message>> mBackwardList;
     OutputQueue mSending;
     OutputQueue::iterator mNextUnsent;
+    struct SendingIdxEntry
+    {
+        OutputQueue::iterator first; //first item in the queue with this msgxid
+        unsigned count; //number of items with this msgxid
+    };
+    /** Maps a msgxid to the items in the send queue that refer to it
+     * (NEWMSG or MSGUPDX). Must be updated on every insertion and removal
+     * of such items, see \c addToSendingIndex() and \c removeFromSendingIndex() */
+    std::unordered_map<karere::Id, SendingIdxEntry> mSendingIdxForXid;
+    /** Slab allocator for the messages of this chat. Messages can outlive it */
+    MessagePool mMsgPool;
     bool mIsFirstJoin = true;
-    std::map<karere::Id, Idx> mIdToIndexMap;
+    karere::IdHashMap<Idx> mIdToIndexMap;
     karere::Id mLastReceivedId;
     Idx mLastReceivedIdx = CHATD_IDX_INVALID;
     karere::Id mLastSeenId;
     Idx mLastSeenIdx = CHATD_IDX_INVALID;
+    /** The value returned by unreadMsgCount(). Updated incrementally when
+     * messages arrive or are edited, and when the last-seen pointer moves
+     * forward within RAM history. In the other cases it is invalidated, and
+     * recalculated from the history when requested. Persisted in the db */
+    mutable int mUnreadCount = 0;
+    mutable bool mUnreadCountValid = false;
     Idx mLastIdxReceivedFromServer = CHATD_IDX_INVALID;
     karere::Id mLastIdReceivedFromServer;
     Listener* mListener;
@@ -559,21 +577,54 @@ protected:
      * of new messages may work synchronously and not be delayed.
      */
     Idx mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+    /** While decryption is halted, the decryption of up to
+     * \c ICrypto::decryptAheadWindow() queued messages after the halted one is
+     * started in advance, so that the crypto module can decrypt them in parallel.
+     * Their results are processed in order, when decryption resumes and reaches
+     * them, exactly as if they were decrypted at that point. The crypto module
+     * works on a private copy of each message, so a message can be freed (i.e.
+     * by a history truncate) while its decryption is still in progress */
+    struct DecryptAheadItem
+    {
+        std::shared_ptr<Message> copy;
+        promise::Promise<Message*> pms;
+    };
+    std::map<Idx, DecryptAheadItem> mDecryptAhead;
     uint32_t mLastMsgTs;
     bool mIsGroup;
     // ====
     std::map<karere::Id, Message*> mPendingEdits;
-    std::map<BackRefId, Idx> mRefidToIdxMap;
+    karere::IdHashMap<Idx> mRefidToIdxMap;
+    /** Indexes of old history messages received from server in the current
+     * OLDMSG burst, which are in RAM but not yet written to the db. They are
+     * written in one go via \c DbInterface::addMsgsToHistory() when the
+     * fetch completes (HISTDONE), or earlier if something needs the db to be
+     * up to date */
+    std::vector<Idx> mPendingHistDbWrites;
+    /** Estimated memory used by the RAM history buffer, see \c msgRamSize().
+     * Updated incrementally when messages are added, and recounted when messages
+     * are removed, as messages may change size after being added (i.e. decryption) */
+    size_t mRamHistoryBytes = 0;
+    /** Position of this chat in the client's history LRU list */
+    std::list<Chat*>::iterator mHistoryLruPos;
+    bool mHistoryEvictable = true;
+    bool mHistoryEvictionScheduled = false;
+    /** Whether messages have been evicted from the RAM history buffer. If so,
+     * msgIndexFromId() looks up the ids it doesn't know in the db */
+    bool mHasEvictedHistory = false;
+    /** The minimum number of newest messages that are always kept in RAM */
+    enum { kMinRamHistoryMsgs = 16 };
     Chat(Connection& conn, karere::Id chatid, Listener* listener,
     const karere::SetOfIds& users, uint32_t chatCreationTs, ICrypto* crypto, bool isGroup);
-    void push_forward(Message* msg) { mForwardList.emplace_back(msg); }
-    void push_back(Message* msg) { mBackwardList.emplace_back(msg); }
+    void push_forward(Message* msg);
+    void push_back(Message* msg);
     Message* oldest() const { return (!mBackwardList.empty()) ? mBackwardList.back().get() : mForwardList.front().get(); }
     Message* newest() const { return (!mForwardList.empty())? mForwardList.back().get() : mBackwardList.front().get(); }
     void clear()
     {
         mBackwardList.clear();
         mForwardList.clear();
+        mDecryptAhead.clear();
     }
     // msgid can be 0 in case of rejections
     Idx msgConfirm(karere::Id msgxid, karere::Id msgid);
@@ -581,6 +632,7 @@ protected:
     Message* msgRemoveFromSending(karere::Id msgxid, karere::Id msgid);
     Idx msgIncoming(bool isNew, Message* msg, bool isLocal=false);
     bool msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx);
+    void decryptAhead(bool isNew);
     void msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx);
     void onUserJoin(karere::Id userid, Priv priv);
     void onUserLeave(karere::Id userid);
@@ -617,6 +669,20 @@ protected:
     void findAndNotifyLastTextMsg();
     void notifyLastTextMsg();
     void onMsgTimestamp(uint32_t ts); //support for newest-message-timestamp
+    void flushHistoryToDb();
+    static size_t msgRamSize(const Message& msg);
+    void onRamHistoryAdded(const Message& msg);
+    void updateRamHistoryBytes();
+    void touchHistory();
+    size_t evictOldHistory(size_t bytesToFree);
+    bool isUnreadCandidate(const Message& msg) const;
+    unsigned pendingHistUnreadCount(Idx after) const;
+    int calculateUnreadCount() const;
+    void adjustUnreadCount(int delta);
+    void invalidateUnreadCount();
+    /** @brief Updates the unread count after the last-seen index has moved
+     * from \c prevIdx to \c mLastSeenIdx */
+    void onLastSeenIdxChanged(Idx prevIdx);
     bool manualResendWhenUserJoins() const;
     friend class Connection;
     friend class Client;
@@ -628,6 +694,9 @@ public:
     ~Chat();
     /** @brief The chatid of this chat */
     karere::Id chatId() const { return mChatId; }
+    /** @brief The allocator for messages that are loaded or received in this chat.
+     * Use as <tt>new (chat.msgPool()) Message(...)</tt> */
+    MessagePool& msgPool() { return mMsgPool; }
     /** @brief The chatd client */
     Client& client() const { return mClient; }
     /** @brief The lowest index of a message in the RAM history buffer */
@@ -640,6 +709,17 @@ public:
      * @note Note that there may be more messages in history db, but not loaded
      * into memory*/
     Idx size() const { return mForwardList.size() + mBackwardList.size(); }
+    /** @brief The estimated memory used by the messages in the history buffer (in RAM),
+     * in bytes */
+    size_t ramHistoryBytes() const { return mRamHistoryBytes; }
+    /** @brief Whether the oldest messages in the RAM history buffer of this chat
+     * can be evicted when the client's RAM history budget is exceeded. Evicted
+     * messages remain in the db and are loaded again when history is requested.
+     * Should be disabled while the chat is open in the app, as the app may keep
+     * references to the messages.
+     */
+    void setHistoryEvictable(bool evictable) { mHistoryEvictable = evictable; }
+    bool isHistoryEvictable() const { return mHistoryEvictable; }
     /** @brief Whether we have any messages in the history buffer */
     bool empty() const { return mForwardList.empty() && mBackwardList.empty();}
     bool isDisabled() const { return mIsDisabled; }
@@ -787,14 +867,22 @@ public:
      * @brief Returns the index of the message with the specified msgid.
      * @param msgid The message id whose index to find
      * @returns The index of the message inside the RAM history buffer.
-     *  If no such message exists in the RAM history buffer, CHATD_IDX_INVALID
-     * is returned
+     *  If messages have been evicted from the RAM history buffer, and the
+     * message is one of them, its index is looked up in the db. In that case
+     * the index is below \c lownum(), and the message can be loaded with
+     * \c loadEvictedMsg(). Otherwise, if no such message exists in the RAM
+     * history buffer, CHATD_IDX_INVALID is returned
      */
-    Idx msgIndexFromId(karere::Id msgid) const
-    {
-        auto it = mIdToIndexMap.find(msgid);
-        return (it == mIdToIndexMap.end()) ? CHATD_IDX_INVALID : it->second;
-    }
+    Idx msgIndexFromId(karere::Id msgid) const;
+
+    /**
+     * @brief Loads from the db a message that has been evicted from the RAM
+     * history buffer, i.e. one for which \c msgIndexFromId() returned an index
+     * below \c lownum().
+     * @returns A new message, owned by the caller, or \c nullptr if there is
+     * no such message in the db
+     */
+    Message* loadEvictedMsg(Idx idx);
 
     /**
      * @brief Initiates fetching more history - from local RAM history buffer,
@@ -972,6 +1060,8 @@ protected:
     template <bool mustBeInSending=false>
     void rejectGeneric(uint8_t opcode);
     void moveItemToManualSending(OutputQueue::iterator it, ManualSendReason reason);
+    void addToSendingIndex(OutputQueue::iterator it);
+    void removeFromSendingIndex(OutputQueue::iterator it);
     void handleTruncate(const Message& msg, Idx idx);
     void deleteMessagesBefore(Idx idx);
     void createMsgBackRefs(Message& msg);
@@ -999,6 +1089,14 @@ protected:
     std::map<int, std::shared_ptr<Connection>> mConnections;
 /// maps a chatid to the handling Shard connection
     std::map<karere::Id, Connection*> mConnectionForChatId;
+/// chats ordered by last access to their history, most recent first.
+/// Must be declared before mChatForChatId, as chats remove themselves on destruction
+    std::list<Chat*> mHistoryLru;
+    size_t mRamHistoryBudget = kDefaultRamHistoryBudget;
+    size_t mRamHistoryBytes = 0;
+    uint64_t mEvictedMsgCount = 0;
+/// maps the msgxids of unconfirmed new messages to the chats whose send queue contains them
+    std::unordered_map<karere::Id, Chat*> mChatForMsgxid;
 /// maps chatids to the Message object
     std::map<karere::Id, std::shared_ptr<Chat>> mChatForChatId;
     karere::Id mUserId;
@@ -1013,8 +1111,10 @@ protected:
     bool onMsgAlreadySent(karere::Id msgxid, karere::Id msgid);
     void msgConfirm(karere::Id msgxid, karere::Id msgid);
     void sendKeepalive();
+    void evictHistory();
 public:
     enum: uint32_t { kOptManualResendWhenUserJoins = 1 };
+    enum: size_t { kDefaultRamHistoryBudget = 32 * 1024 * 1024 };
     unsigned inactivityCheckIntervalSec = 20;
     uint32_t options = 0;
     MyMegaApi *mApi;
@@ -1045,6 +1145,16 @@ public:
     void notifyUserIdle();
     void notifyUserActive();
     bool isMessageReceivedConfirmationActive() const;
+    /** @brief Sets the memory budget for the RAM history buffers of all chats,
+     * in bytes. When it is exceeded, the oldest messages of the least recently
+     * used chats are evicted from RAM. 0 means no limit.
+     */
+    void setRamHistoryBudget(size_t bytes);
+    size_t ramHistoryBudget() const { return mRamHistoryBudget; }
+    /** @brief The estimated memory used by the RAM history buffers of all chats */
+    size_t ramHistoryBytes() const { return mRamHistoryBytes; }
+    /** @brief The total number of messages evicted from RAM history buffers */
+    uint64_t evictedMsgCount() const { return mEvictedMsgCount; }
     friend class Connection;
     friend class Chat;
 };
@@ -1063,6 +1173,10 @@ static inline const char* connStateToStr(Connection::State state)
     }
 }
 
+/** @brief A batch of history messages with their indexes, to be written to the db
+ * in one go */
+typedef std::vector<std::pair<const Message*, Idx>> HistoryBatch;
+
 struct ChatDbInfo
 {
     karere::Id oldestDbId;
@@ -1070,6 +1184,9 @@ struct ChatDbInfo
     Idx newestDbIdx;
     karere::Id lastSeenId;
     karere::Id lastRecvId;
+    /** The persisted unread count, valid only if \c hasUnreadCount is set */
+    int unreadCount;
+    bool hasUnreadCount;
 };
 
 class DbInterface
@@ -1087,6 +1204,10 @@ public:
     /// an assertion will be triggered. Therefore, the application must always try to read not less than
     /// \c count messages, in case they are avaialble in the db.
     virtual void fetchDbHistory(Idx startIdx, unsigned count, std::vector<Message*>& messages) = 0;
+    /// @brief Returns a new message with the specified index from the db, or \c nullptr
+    /// if there is no such message. Unlike \c fetchDbHistory(), it is not tied to
+    /// the RAM history buffer
+    virtual Message* fetchDbMessage(Idx idx) = 0;
     virtual void saveMsgToSending(Chat::SendingItem& msg) = 0;
     virtual void updateMsgInSending(const chatd::Chat::SendingItem& item) = 0;
     virtual void addBlobsToSendingItem(uint64_t rowid, const MsgCommand* msgCmd, const Command* keyCmd) = 0;
@@ -1095,6 +1216,9 @@ public:
     virtual void updateMsgKeyIdInSending(uint64_t rowid, KeyId keyid) = 0;
     virtual void loadSendQueue(Chat::OutputQueue& queue) = 0;
     virtual void addMsgToHistory(const Message& msg, Idx idx) = 0;
+    /// Adds several messages to the history in one transaction. Each message must be
+    /// adjacent to the db history range, after the previous ones have been added
+    virtual void addMsgsToHistory(const HistoryBatch& msgs) = 0;
     virtual void confirmKeyOfSendingItem(uint64_t rowid, KeyId keyid) = 0;
     virtual void updateMsgInHistory(karere::Id msgid, const Message& msg) = 0;
     virtual Idx getIdxOfMsgid(karere::Id msgid) = 0;
@@ -1106,6 +1230,9 @@ public:
     virtual void truncateHistory(const chatd::Message& msg) = 0;
     virtual void setLastSeen(karere::Id msgid) = 0;
     virtual void setLastReceived(karere::Id msgid) = 0;
+    virtual void setUnreadCount(int count) = 0;
+    /** @brief Marks the persisted unread count as unknown */
+    virtual void clearUnreadCount() = 0;
     virtual chatd::Idx getOldestIdx() = 0;
     virtual void sendingItemMsgupdxToMsgupd(const chatd::Chat::SendingItem& item, karere::Id msgid) = 0;
     virtual void setHaveAllHistory() = 0;
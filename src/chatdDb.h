@@ -12,6 +12,34 @@ protected:
     chatd::Chat& mMessages;
     std::string mSendingTblName;
     std::string mHistTblName;
+    /** The index range of the history of this chat in the db, kept in memory,
+     * so that addMsgToHistory() can check for discontinuities without querying
+     * the db. Both are CHATD_IDX_INVALID if there is no history in the db.
+     * Loaded by getHistoryInfo() or, if that was not called yet, on first use */
+    chatd::Idx mDbLowIdx = CHATD_IDX_INVALID;
+    chatd::Idx mDbHighIdx = CHATD_IDX_INVALID;
+    bool mHaveDbRange = false;
+    /** The number of rows written by one multi-row insert statement in addMsgsToHistory() */
+    enum { kHistInsertBatchRows = 32 };
+    void loadDbRange()
+    {
+        SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
+        stmt.bind(mMessages.chatId()).step();
+        setDbRange(stmt);
+    }
+    void setDbRange(SqliteStmt& stmt)
+    {
+        if (sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+        {
+            mDbLowIdx = mDbHighIdx = CHATD_IDX_INVALID;
+        }
+        else
+        {
+            mDbLowIdx = stmt.intCol(0);
+            mDbHighIdx = stmt.intCol(1);
+        }
+        mHaveDbRange = true;
+    }
 public:
     ChatdSqliteDb(chatd::Chat& msgs, SqliteDb& db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
         :mDb(db), mMessages(msgs), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
@@ -19,6 +47,7 @@ public:
     {
         SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
         stmt.bind(mMessages.chatId()).step(); //will always return a row, even if table empty
+        setDbRange(stmt);
         auto minIdx = stmt.intCol(0); //WARNING: the chatd implementation uses uint32_t values for idx.
         info.newestDbIdx = stmt.intCol(1);
         if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) //no db history
@@ -38,11 +67,13 @@ public:
             CHATD_LOG_WARNING("Db: Newest msgid in db is null, telling chatd we don't have local history");
             info.oldestDbId = 0;
         }
-        SqliteStmt stmt3(mDb, "select last_seen, last_recv from chats where chatid=?");
+        SqliteStmt stmt3(mDb, "select last_seen, last_recv, unread_count from chats where chatid=?");
         stmt3 << mMessages.chatId();
         stmt3.stepMustHaveData();
         info.lastSeenId = stmt3.uint64Col(0);
         info.lastRecvId = stmt3.uint64Col(1);
+        info.hasUnreadCount = (sqlite3_column_type(stmt3, 2) != SQLITE_NULL);
+        info.unreadCount = info.hasUnreadCount ? stmt3.intCol(2) : 0;
     }
     void assertAffectedRowCount(int count, const char* opname=nullptr)
     {
@@ -118,9 +149,34 @@ public:
         mDb.query("update sending set keyid = ? where rowid = ?", keyid, rowid);
         assertAffectedRowCount(1, "updateMsgKeyIdInSending");
     }
+    void checkHistoryAdjacency(const chatd::Message& msg, chatd::Idx idx)
+    {
+        if ((mDbLowIdx != CHATD_IDX_INVALID) && (idx != mDbLowIdx-1) && (idx != mDbHighIdx+1))
+        {
+            CHATD_LOG_ERROR("chatid %s: addMsgToHistory: history discontinuity detected: "
+                "index of added msg %s is not adjacent to neither end of db history: "
+                "add idx=%d, histlow=%d, histhigh=%d, fwdStart=%d, lownum=%d, highnum=%d",
+                mMessages.chatId().toString().c_str(), msg.id().toString().c_str(),
+                idx, mDbLowIdx, mDbHighIdx, mMessages.forwardStart(), mMessages.lownum(), mMessages.highnum());
+            assert(false);
+        }
+    }
+    void extendDbRange(chatd::Idx idx)
+    {
+        if ((mDbLowIdx == CHATD_IDX_INVALID) || (idx < mDbLowIdx))
+            mDbLowIdx = idx;
+        if ((mDbHighIdx == CHATD_IDX_INVALID) || (idx > mDbHighIdx))
+            mDbHighIdx = idx;
+    }
     virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
     {
-#if 1
+        if (!mHaveDbRange)
+            loadDbRange();
+
+        checkHistoryAdjacency(msg, idx);
+
+#ifdef CHATD_DB_VERIFY_HISTORY_CONTINUITY
+        //debug-only verification of the in-memory range against the actual db contents
         SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from history where chatid = ?");
         stmt << mMessages.chatId();
         stmt.step();
@@ -136,11 +192,86 @@ public:
                 idx, low, high, count, mMessages.forwardStart(), mMessages.lownum(), mMessages.highnum());
             assert(false);
         }
+        if ((count > 0) && ((low != mDbLowIdx) || (high != mDbHighIdx)))
+        {
+            CHATD_LOG_ERROR("chatid %s: addMsgToHistory: in-memory db range %d - %d "
+                "does not match db range %d - %d", mMessages.chatId().toString().c_str(),
+                mDbLowIdx, mDbHighIdx, low, high);
+            assert(false);
+        }
 #endif
         mDb.query("insert into history"
             "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid) "
             "values(?,?,?,?,?,?,?,?,?,?)", idx, mMessages.chatId(), msg.id(), msg.keyid,
             msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId);
+        extendDbRange(idx);
+    }
+    virtual void addMsgsToHistory(const chatd::HistoryBatch& msgs)
+    {
+        if (msgs.empty())
+            return;
+        if (!mHaveDbRange)
+            loadDbRange();
+
+        SqliteTransaction transaction(mDb);
+        size_t i = 0;
+        if (msgs.size() >= kHistInsertBatchRows)
+        {
+            // sqlite limits the number of bound parameters per statement, so insert in chunks
+            std::string sql = "insert into history"
+                "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid) values";
+            for (size_t row = 0; row < kHistInsertBatchRows; row++)
+            {
+                sql.append(row ? ",(?,?,?,?,?,?,?,?,?,?)" : "(?,?,?,?,?,?,?,?,?,?)");
+            }
+            SqliteStmt stmt(mDb, sql);
+            while (msgs.size() - i >= kHistInsertBatchRows)
+            {
+                auto chunkStart = i;
+                auto savedLow = mDbLowIdx;
+                auto savedHigh = mDbHighIdx;
+                try
+                {
+                    for (size_t end = i + kHistInsertBatchRows; i < end; i++)
+                    {
+                        auto& msg = *msgs[i].first;
+                        auto idx = msgs[i].second;
+                        checkHistoryAdjacency(msg, idx);
+                        extendDbRange(idx);
+                        stmt << idx << mMessages.chatId() << msg.id() << msg.keyid << msg.type
+                             << msg.userid << msg.ts << msg.updated << msg << msg.backRefId;
+                    }
+                    stmt.step();
+                    stmt.reset().clearBind();
+                }
+                catch(std::exception& e)
+                {
+                    // sqlite rolls back the failed statement, so none of the rows
+                    // of the chunk were inserted. Insert the rest one by one, so
+                    // that only the offending rows are lost
+                    CHATD_LOG_WARNING("chatid %s: addMsgsToHistory: batch insert failed (%s), "
+                        "inserting messages one by one", mMessages.chatId().toString().c_str(), e.what());
+                    mDbLowIdx = savedLow;
+                    mDbHighIdx = savedHigh;
+                    i = chunkStart;
+                    break;
+                }
+            }
+        }
+        for (; i < msgs.size(); i++)
+        {
+            try
+            {
+                addMsgToHistory(*msgs[i].first, msgs[i].second);
+            }
+            catch(std::exception& e)
+            {
+                CHATD_LOG_ERROR("chatid %s: addMsgsToHistory: error adding msg %s (idx %d) to db: %s",
+                    mMessages.chatId().toString().c_str(), msgs[i].first->id().toString().c_str(),
+                    msgs[i].second, e.what());
+            }
+        }
+        transaction.commit();
     }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
     {
@@ -161,7 +292,7 @@ public:
             assert((opcode == chatd::OP_NEWMSG) || (opcode == chatd::OP_MSGUPD)
                    || (opcode == chatd::OP_MSGUPDX));
 
-            auto msg = new chatd::Message(stmt.int64Col(2), mMessages.client().userId(),
+            auto msg = new (mMessages.msgPool()) chatd::Message(stmt.int64Col(2), mMessages.client().userId(),
                     stmt.intCol(6), stmt.intCol(7), nullptr, 0, true, (chatd::KeyId)stmt.intCol(3),
                     (unsigned char)stmt.intCol(5));
             stmt.blobCol(4, *msg);
@@ -170,7 +301,7 @@ public:
             {
                 Buffer refs;
                 stmt.blobCol(9, refs);
-                refs.read(0, msg->backRefs);
+                msg->backRefs.read(refs, 0);
             }
             Buffer recpts;
             stmt.blobCol(10, recpts);
@@ -202,12 +333,28 @@ public:
                 assert(false);
             }
 #endif
-            auto msg = new chatd::Message(msgid, userid, ts, stmt.intCol(8), std::move(buf),
+            auto msg = new (mMessages.msgPool()) chatd::Message(msgid, userid, ts, stmt.intCol(8), std::move(buf),
                 false, keyid, (unsigned char)stmt.intCol(3));
             msg->backRefId = stmt.uint64Col(7);
             messages.push_back(msg);
         }
     }
+    virtual chatd::Message* fetchDbMessage(chatd::Idx idx)
+    {
+        SqliteStmt stmt(mDb, "select msgid, userid, ts, type, data, keyid, backrefid, updated from history "
+            "where chatid = ?1 and idx = ?2");
+        stmt << mMessages.chatId() << idx;
+        if (!stmt.step())
+            return nullptr;
+        karere::Id msgid(stmt.uint64Col(0));
+        karere::Id userid(stmt.uint64Col(1));
+        Buffer buf;
+        stmt.blobCol(4, buf);
+        auto msg = new chatd::Message(msgid, userid, stmt.uintCol(2), stmt.intCol(7), std::move(buf),
+            false, stmt.uintCol(5), (unsigned char)stmt.intCol(3));
+        msg->backRefId = stmt.uint64Col(6);
+        return msg;
+    }
     virtual chatd::Idx getIdxOfMsgid(karere::Id msgid)
     {
         SqliteStmt stmt(mDb, "select idx from history where chatid = ? and msgid = ?");
@@ -280,6 +427,8 @@ public:
         if (idx == CHATD_IDX_INVALID)
             throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
         mDb.query("delete from history where chatid = ? and idx < ?", mMessages.chatId(), idx);
+        if (mHaveDbRange)
+            mDbLowIdx = idx;
 #if 1
         SqliteStmt stmt(mDb, "select type from history where chatid=? and msgid=?");
         stmt << mMessages.chatId() << msg.id();
@@ -307,6 +456,16 @@ public:
         mDb.query("update chats set last_recv=? where chatid=?", msgid, mMessages.chatId());
         assertAffectedRowCount(1);
     }
+    virtual void setUnreadCount(int count)
+    {
+        mDb.query("update chats set unread_count=? where chatid=?", count, mMessages.chatId());
+        assertAffectedRowCount(1);
+    }
+    virtual void clearUnreadCount()
+    {
+        mDb.query("update chats set unread_count=NULL where chatid=?", mMessages.chatId());
+        assertAffectedRowCount(1);
+    }
     virtual void setHaveAllHistory()
     {
         mDb.query(
@@ -15,6 +15,7 @@ enum
 class Chat;
 class ICrypto
 {
+protected:
     void *appCtx;
     
 public:
@@ -71,6 +72,14 @@ public:
  */
     virtual promise::Promise<Message*> msgDecrypt(Message* src) = 0;
 
+/**
+ * @brief How many messages after a message whose decryption is pending the client
+ * may pass to \c msgDecrypt() in advance, without waiting for it. Non-zero only
+ * if the crypto module can decrypt several messages in parallel. The results are
+ * still processed by the client in message order.
+ */
+    virtual unsigned decryptAheadWindow() const { return 0; }
+
 /**
  * @brief The chatroom connection (to the chatd server shard) state state has changed.
  */
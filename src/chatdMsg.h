@@ -236,6 +236,131 @@ enum Priv: signed char
     PRIV_OPER = 3
 };
 
+/** @brief List of backrefs of a message. Stores up to \c kInlineCount entries
+ * inside the object itself, and allocates on the heap only if there are more.
+ * Most messages have only a few backrefs, so this saves an allocation per message.
+ */
+class BackRefList
+{
+public:
+    enum { kInlineCount = 4 };
+    BackRefList() {}
+    BackRefList(const BackRefList& other) { assign(other.mItems, other.mSize); }
+    BackRefList& operator=(const BackRefList& other)
+    {
+        if (&other != this)
+            assign(other.mItems, other.mSize);
+        return *this;
+    }
+    ~BackRefList()
+    {
+        if (mItems != mInline)
+            ::free(mItems);
+    }
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    BackRefId* data() { return mItems; }
+    const BackRefId* data() const { return mItems; }
+    BackRefId* begin() { return mItems; }
+    BackRefId* end() { return mItems+mSize; }
+    const BackRefId* begin() const { return mItems; }
+    const BackRefId* end() const { return mItems+mSize; }
+    BackRefId& operator[](size_t i) { assert(i < mSize); return mItems[i]; }
+    const BackRefId& operator[](size_t i) const { assert(i < mSize); return mItems[i]; }
+    void clear() { mSize = 0; }
+    void push_back(BackRefId ref)
+    {
+        if (mSize >= mCapacity)
+            reserve(mCapacity*2);
+        mItems[mSize++] = ref;
+    }
+    void reserve(size_t count)
+    {
+        if (count <= mCapacity)
+            return;
+        BackRefId* items = (BackRefId*)::malloc(count*sizeof(BackRefId));
+        if (!items)
+            throw std::runtime_error("BackRefList::reserve: Out of memory");
+        memcpy(items, mItems, mSize*sizeof(BackRefId));
+        if (mItems != mInline)
+            ::free(mItems);
+        mItems = items;
+        mCapacity = count;
+    }
+    void assign(const BackRefId* items, size_t count)
+    {
+        mSize = 0;
+        reserve(count);
+        if (count)
+            memcpy(mItems, items, count*sizeof(BackRefId));
+        mSize = count;
+    }
+    /** @brief Appends the backrefs serialized in \c buf, starting at \c offset */
+    void read(const StaticBuffer& buf, size_t offset)
+    {
+        assert((buf.dataSize()-offset) % sizeof(BackRefId) == 0);
+        size_t count = (buf.dataSize()-offset) / sizeof(BackRefId);
+        reserve(mSize+count);
+        for (size_t i = 0; i < count; i++)
+            mItems[mSize++] = buf.read<BackRefId>(offset+i*sizeof(BackRefId));
+    }
+protected:
+    BackRefId mInline[kInlineCount];
+    BackRefId* mItems = mInline;
+    size_t mSize = 0;
+    size_t mCapacity = kInlineCount;
+};
+
+class Message;
+
+/** @brief Slab allocator for Message objects.
+ * Messages are allocated in slabs of \c kSlotsPerSlab objects, which cuts
+ * malloc overhead and fragmentation when many messages are resident. Every
+ * allocation is prefixed by a header that points to its slab, so a message
+ * can be deleted without knowing the pool, and can even outlive it. A slab is
+ * freed as soon as its last message is deleted, so clearing the history buffer
+ * of a chat releases its memory in bulk.
+ * Not thread safe. Pooled messages are allocated and deleted under sdkMutex,
+ * which serializes the karere thread with the app threads that call into the
+ * API (i.e. msgSubmit() and the manual-send paths). Messages allocated outside
+ * any pool, via heapAlloc(), can be created and deleted from any thread.
+ */
+class MessagePool
+{
+public:
+    enum { kSlotsPerSlab = 64 };
+    MessagePool() {}
+    ~MessagePool();
+    /** @brief Allocates memory for a Message object. Sizes other than
+     * sizeof(Message) are allocated on the heap */
+    void* alloc(size_t size);
+    /** @brief Allocates memory with the same layout as alloc(), but outside
+     * of any pool */
+    static void* heapAlloc(size_t size);
+    /** @brief Releases memory returned by alloc() or heapAlloc() */
+    static void release(void* ptr);
+    /** @brief The number of slabs currently allocated by this pool */
+    size_t slabCount() const { return mSlabCount; }
+    /** @brief The number of memory bytes allocated by this pool */
+    size_t allocatedBytes() const;
+protected:
+    struct Slab;
+    union SlotHeader
+    {
+        Slab* slab; //nullptr if the memory was allocated outside of a pool
+        long double align; //keep the object after the header aligned
+    };
+    Slab* mPartial = nullptr; //slabs that have free slots
+    Slab* mFull = nullptr;
+    size_t mSlabCount = 0;
+    Slab* newSlab();
+    void freeSlab(Slab* slab);
+    static void unlink(Slab*& list, Slab* slab);
+    static void pushFront(Slab*& list, Slab* slab);
+    MessagePool(const MessagePool&) = delete;
+    MessagePool& operator=(const MessagePool&) = delete;
+};
+
 class Message: public Buffer
 {
 public:
@@ -298,6 +423,11 @@ public:
     };
 
 private:
+    /** Payloads up to this size are stored inside the Message object itself,
+     * without a separate heap allocation. Most chat messages are short
+     */
+    enum { kInlineDataSize = 96 };
+    char mInlineData[kInlineDataSize];
 //avoid setting the id and flag pairs one by one by making them accessible only by setXXX(Id,bool)
     karere::Id mId;
     bool mIdIsXid = false;
@@ -311,7 +441,7 @@ public:
     uint32_t keyid;
     unsigned char type;
     BackRefId backRefId;
-    std::vector<BackRefId> backRefs;
+    BackRefList backRefs;
     mutable void* userp;
     mutable uint8_t userFlags = 0;
     karere::Id id() const { return mId; }
@@ -322,13 +452,26 @@ public:
     explicit Message(karere::Id aMsgid, karere::Id aUserid, uint32_t aTs, uint16_t aUpdated,
           Buffer&& buf, bool aIsSending=false, KeyId aKeyid=CHATD_KEYID_INVALID,
           unsigned char aType=kMsgNormal, void* aUserp=nullptr)
-      :Buffer(std::forward<Buffer>(buf)), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid),
-          ts(aTs), updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp){}
+      :Buffer(mInlineData, kInlineDataSize, kInline), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid),
+          ts(aTs), updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp)
+    {
+        takeFrom(std::forward<Buffer>(buf));
+    }
     explicit Message(karere::Id aMsgid, karere::Id aUserid, uint32_t aTs, uint16_t aUpdated,
             const char* msg, size_t msglen, bool aIsSending=false,
             KeyId aKeyid=CHATD_KEYID_INVALID, unsigned char aType=kMsgInvalid, void* aUserp=nullptr)
-        :Buffer(msg, msglen), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid), ts(aTs),
-            updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp){}
+        :Buffer(mInlineData, kInlineDataSize, kInline), mId(aMsgid), mIdIsXid(aIsSending), userid(aUserid), ts(aTs),
+            updated(aUpdated), keyid(aKeyid), type(aType), userp(aUserp)
+    {
+        if (msg && msglen)
+            assign(msg, msglen);
+    }
+
+    static void* operator new(size_t size) { return MessagePool::heapAlloc(size); }
+    static void* operator new(size_t size, MessagePool& pool) { return pool.alloc(size); }
+    static void operator delete(void* ptr) { MessagePool::release(ptr); }
+    //called if the constructor throws
+    static void operator delete(void* ptr, MessagePool&) { MessagePool::release(ptr); }
 
     /** @brief Returns the ManagementInfo structure contained within the message
      * content. Throws if the message is not a management message, or if the
@@ -361,7 +504,7 @@ public:
     {
         return backRefs.empty()
             ?StaticBuffer(nullptr, 0)
-            :StaticBuffer((const char*)&backRefs[0], backRefs.size()*8);
+            :StaticBuffer((const char*)backRefs.data(), backRefs.size()*8);
     }
 
     /** @brief Creates a human readable string that describes the management
@@ -2,6 +2,8 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <string>
+#include <unordered_map>
 
 struct SqliteString
 {
@@ -20,12 +22,68 @@ class SqliteDb
 {
 protected:
     friend class SqliteStmt;
+    friend class SqliteTransaction;
     sqlite3* mDb = nullptr;
     bool mCommitEach = true;
     bool mHasOpenTransaction = false;
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+    /** Prepared statements that are not currently in use by a SqliteStmt,
+     * keyed by their sql. A SqliteStmt checks out a statement from here
+     * (removing it from the map, so nested use of the same sql just prepares
+     * another one), and on destruction resets it and puts it back */
+    std::unordered_map<std::string, sqlite3_stmt*> mStmtCache;
+    size_t mStmtCacheMaxSize = 256;
+    uint64_t mStmtCacheHits = 0;
+    uint64_t mStmtCacheMisses = 0;
     inline int step(SqliteStmt& stmt);
+    sqlite3_stmt* acquireStmt(const char* sql)
+    {
+        if (mStmtCacheMaxSize)
+        {
+            auto it = mStmtCache.find(sql);
+            if (it != mStmtCache.end())
+            {
+                auto stmt = it->second;
+                mStmtCache.erase(it);
+                mStmtCacheHits++;
+                return stmt;
+            }
+        }
+        mStmtCacheMisses++;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(mDb, sql, -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            const char* errMsg = sqlite3_errmsg(mDb);
+            if (!errMsg)
+                errMsg = "(Unknown error)";
+            throw std::runtime_error(std::string(
+                "Error creating sqlite statement with sql:\n'")+sql+"'\n"+errMsg);
+        }
+        assert(stmt);
+        return stmt;
+    }
+    void releaseStmt(sqlite3_stmt* stmt)
+    {
+        // sqlite3_reset() returns the error of the last step, if any. That has
+        // already been reported to the user of the statement, so ignore it here
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (!mDb || (mStmtCache.size() >= mStmtCacheMaxSize))
+        {
+            sqlite3_finalize(stmt);
+            return;
+        }
+        auto ret = mStmtCache.emplace(sqlite3_sql(stmt), stmt);
+        if (!ret.second) //an identical statement is already cached
+            sqlite3_finalize(stmt);
+    }
+    void clearStmtCache()
+    {
+        for (auto& item: mStmtCache)
+            sqlite3_finalize(item.second);
+        mStmtCache.clear();
+    }
     void beginTransaction()
     {
         assert(!mHasOpenTransaction);
@@ -71,6 +129,7 @@ public:
             return;
         if (!mCommitEach)
             commitTransaction();
+        clearStmtCache();
         sqlite3_close(mDb);
         mDb = nullptr;
         mLastCommitTs = 0;
@@ -88,6 +147,18 @@ public:
     }
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
+    /** @brief Sets the max number of idle prepared statements kept for reuse.
+     * Zero disables statement caching */
+    void setStmtCacheMaxSize(size_t size)
+    {
+        mStmtCacheMaxSize = size;
+        if (mStmtCache.size() > size)
+            clearStmtCache();
+    }
+    /** @brief The number of statements that were reused from the cache */
+    uint64_t stmtCacheHits() const { return mStmtCacheHits; }
+    /** @brief The number of statements that had to be prepared by sqlite */
+    uint64_t stmtCacheMisses() const { return mStmtCacheMisses; }
     operator sqlite3*() { return mDb; }
     operator const sqlite3*() const { return mDb; }
     template <class... Args>
@@ -145,6 +216,7 @@ protected:
     sqlite3_stmt* mStmt;
     SqliteDb& mDb;
     int mLastBindCol = 0;
+    SqliteStmt(const SqliteStmt&) = delete;
     void check(int code, const char* opname)
     {
         if (code != SQLITE_OK)
@@ -169,24 +241,16 @@ protected:
         return msg;
     }
 public:
-    SqliteStmt(SqliteDb& db, const char* sql):mDb(db)
-    {
-        if (sqlite3_prepare_v2(db, sql, -1, &mStmt, nullptr) != SQLITE_OK)
-        {
-            const char* errMsg = sqlite3_errmsg(mDb);
-            if (!errMsg)
-                errMsg = "(Unknown error)";
-            throw std::runtime_error(std::string(
-                "Error creating sqlite statement with sql:\n'")+sql+"'\n"+errMsg);
-        }
-        assert(mStmt);
-    }
+    /** The statement is taken from the db's prepared statement cache, if there
+     * is one there for that sql, and is returned back to it on destruction */
+    SqliteStmt(SqliteDb& db, const char* sql)
+        :mStmt(db.acquireStmt(sql)), mDb(db){}
     SqliteStmt(SqliteDb& db, const std::string& sql)
         :SqliteStmt(db, sql.c_str()){}
     ~SqliteStmt()
     {
         if (mStmt)
-            sqlite3_finalize(mStmt);
+            mDb.releaseStmt(mStmt);
     }
     operator sqlite3_stmt*() { return mStmt; }
     operator const sqlite3_stmt*() const {return mStmt; }
@@ -305,18 +369,39 @@ class SqliteTransaction
 {
 protected:
     SqliteDb* mDb;
+    // In commit-each mode there is no long-running transaction to piggyback on,
+    // so we start and commit/rollback our own
+    bool mIsOwn;
 public:
-    SqliteTransaction(SqliteDb& db): mDb(&db) { mDb->commit(); }
+    SqliteTransaction(SqliteDb& db): mDb(&db), mIsOwn(db.mCommitEach)
+    {
+        if (mIsOwn)
+            mDb->beginTransaction();
+        else
+            mDb->commit();
+    }
     void commit()
     {
         assert(mDb);
-        mDb->commit();
+        if (mIsOwn)
+            mDb->commitTransaction();
+        else
+            mDb->commit();
         mDb = nullptr;
     }
     ~SqliteTransaction()
     {
-        if (mDb)
+        if (!mDb)
+            return;
+        if (mIsOwn)
+        {
+            sqlite3_exec(*mDb, "ROLLBACK", nullptr, nullptr, nullptr);
+            mDb->mHasOpenTransaction = false;
+        }
+        else
+        {
             mDb->rollback();
+        }
     }
 };
 
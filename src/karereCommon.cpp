@@ -21,6 +21,7 @@ void globalInit(void(*postFunc)(void*, void*), uint32_t options, const char* log
     if (logPath)
     {
         karere::gLogger.logToFile(logPath, logSize);
+        karere::gLogger.setAsyncFileLogging();
     }
     services_init(postFunc, options);
 }
@@ -89,4 +90,17 @@ eventloop *get_ev_loop(void *ctx)
 
 #endif
 
+TimerWheel& get_timer_wheel(void *ctx)
+{
+    if (ctx)
+    {
+        return ((megachat::MegaChatApiImpl *)ctx)->timerWheel;
+    }
+    else
+    {
+        static TimerWheel wheel(nullptr);
+        return wheel;
+    }
+}
+
 }
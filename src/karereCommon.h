@@ -95,7 +95,8 @@ typedef std::map<std::string, std::string> StringMap;
 
 /** @brief Globally initializes the karere library and starts the services
  * subsystem. Must be called before any karere code is used.
- * @param logPath The full path to the log file.
+ * @param logPath The full path to the log file. The file is written
+ * asynchronously, see \c Logger::setAsyncFileLogging()
  * @param logSize The rotate size of the log file, in kilobytes. Once the log
  * file reaches this size, its first half is truncated. So the log size at
  * any moment is at least logSize / 2, and at most logSize
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <string>
 #include <set>
+#include <memory>
+#include <utility>
 #include "base64.h"
 #include <buffer.h>
 
@@ -64,6 +66,135 @@ struct SetOfIds: public std::set<karere::Id>
     }
     bool has(Id id) { return find(id) != end(); }
 };
+
+/** @brief A compact hash map with karere::Id keys, using open addressing with
+ * linear probing. Compared to std::map and std::unordered_map it needs no
+ * allocation per element, and a lookup usually touches a single cache line.
+ * The null id is reserved as the empty slot marker, and can't be used as a key.
+ * Provides the subset of the std::map interface that we use. Note that,
+ * unlike with std::map, insertions invalidate iterators.
+ */
+template <class V>
+class IdHashMap
+{
+public:
+    typedef std::pair<Id, V> value_type;
+    typedef value_type* iterator;
+    typedef const value_type* const_iterator;
+    IdHashMap() {}
+    IdHashMap(const IdHashMap&) = delete;
+    IdHashMap& operator=(const IdHashMap&) = delete;
+    size_t size() const { return mCount; }
+    bool empty() const { return mCount == 0; }
+    iterator end() { return nullptr; }
+    const_iterator end() const { return nullptr; }
+    iterator find(Id key) { return const_cast<iterator>(static_cast<const IdHashMap*>(this)->find(key)); }
+    const_iterator find(Id key) const
+    {
+        if (!mCount || !key)
+            return nullptr;
+        for (size_t i = home(key); ; i = (i+1) & mMask)
+        {
+            auto& slot = mSlots[i];
+            if (slot.first == key)
+                return &slot;
+            if (!slot.first)
+                return nullptr;
+        }
+    }
+    std::pair<iterator, bool> emplace(Id key, const V& val)
+    {
+        assert(key);
+        if (!key) //would be taken for an empty slot
+            return std::make_pair(end(), false);
+        if ((mCount+1)*4 > (mMask+1)*3) //keep load factor under 0.75
+            rehash(mMask ? (mMask+1)*2 : kMinCapacity);
+        size_t i = home(key);
+        for (; mSlots[i].first; i = (i+1) & mMask)
+        {
+            if (mSlots[i].first == key)
+                return std::make_pair(&mSlots[i], false);
+        }
+        mSlots[i].first = key;
+        mSlots[i].second = val;
+        mCount++;
+        return std::make_pair(&mSlots[i], true);
+    }
+    V& operator[](Id key)
+    {
+        auto it = emplace(key, V()).first;
+        if (it)
+            return it->second;
+        //null key, the value is not stored
+        mDiscarded = V();
+        return mDiscarded;
+    }
+    size_t erase(Id key)
+    {
+        auto it = find(key); //end() for the null key
+        if (!it)
+            return 0;
+        // Backward shift deletion - move back the following entries of the
+        // cluster that would become unreachable, so we don't need tombstones
+        size_t hole = it - mSlots.get();
+        for (size_t i = (hole+1) & mMask; mSlots[i].first; i = (i+1) & mMask)
+        {
+            size_t h = home(mSlots[i].first);
+            // move the entry if its home slot is not in the range (hole, i]
+            bool reachable = (hole < i) ? (h > hole && h <= i) : (h > hole || h <= i);
+            if (!reachable)
+            {
+                mSlots[hole] = std::move(mSlots[i]);
+                hole = i;
+            }
+        }
+        mSlots[hole].first = Id::null();
+        mSlots[hole].second = V();
+        mCount--;
+        return 1;
+    }
+    void clear()
+    {
+        mSlots.reset();
+        mMask = mCount = 0;
+        mShift = 64;
+    }
+    /** @brief The memory used by the hash table, in bytes */
+    size_t memoryUsage() const { return mSlots ? (mMask+1)*sizeof(value_type) : 0; }
+protected:
+    enum { kMinCapacity = 16 };
+    std::unique_ptr<value_type[]> mSlots;
+    size_t mMask = 0; //capacity - 1, capacity is a power of 2
+    size_t mCount = 0;
+    unsigned mShift = 64; //64 - log2(capacity)
+    V mDiscarded; //returned by operator[] for the null key
+    size_t home(Id key) const
+    {
+        // Fibonacci hashing - ids are usually random, but this also spreads
+        // sequential or otherwise patterned ones
+        return (size_t)((key.val * 0x9E3779B97F4A7C15ull) >> mShift);
+    }
+    void rehash(size_t capacity)
+    {
+        std::unique_ptr<value_type[]> old(std::move(mSlots));
+        size_t oldCapacity = mMask ? mMask+1 : 0;
+        mSlots.reset(new value_type[capacity]());
+        mMask = capacity-1;
+        mShift = 64;
+        for (size_t c = capacity; c > 1; c >>= 1)
+            mShift--;
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            auto& slot = old[i];
+            if (!slot.first)
+                continue;
+            size_t j = home(slot.first);
+            while (mSlots[j].first)
+                j = (j+1) & mMask;
+            mSlots[j] = std::move(slot);
+        }
+    }
+};
 }
 
 namespace std
@@ -98,6 +98,21 @@ void MegaChatApi::setLogToConsole(bool enable)
     MegaChatApiImpl::setLogToConsole(enable);
 }
 
+void MegaChatApi::setDecryptThreads(int count)
+{
+    pImpl->setDecryptThreads(count);
+}
+
+void MegaChatApi::setPersistSymmKeys(bool enable)
+{
+    pImpl->setPersistSymmKeys(enable);
+}
+
+void MegaChatApi::setRamHistoryBudget(long long bytes)
+{
+    pImpl->setRamHistoryBudget(bytes);
+}
+
 int MegaChatApi::init(const char *sid)
 {
     return pImpl->init(sid);
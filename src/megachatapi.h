@@ -1205,6 +1205,45 @@ public:
      */
     static void setLogToConsole(bool enable);
 
+    /**
+     * @brief Sets the number of worker threads used to decrypt received messages
+     *
+     * The signatures of the received messages are verified and their contents decrypted
+     * by these threads, once their keys are available. By default (0), messages are
+     * decrypted by the thread of MEGAchat.
+     *
+     * This function should be called before MegaChatApi::init. Otherwise, it only applies
+     * to chatrooms created afterwards.
+     *
+     * @param count Number of worker threads, or 0 to disable them.
+     */
+    void setDecryptThreads(int count);
+
+    /**
+     * @brief Enable the persistence of the keys shared with other users
+     *
+     * If enabled, the keys shared with other users are saved in the local cache, encrypted,
+     * so they don't need to be recomputed after a restart. By default, it's disabled.
+     *
+     * This function should be called before MegaChatApi::init.
+     *
+     * @param enable True to enable it, false to disable.
+     */
+    void setPersistSymmKeys(bool enable);
+
+    /**
+     * @brief Sets the memory budget for the history of the chatrooms kept in RAM
+     *
+     * When the estimated size of the messages loaded in memory exceeds this budget, the
+     * oldest messages of the least recently used chatrooms are released. They are loaded
+     * again from the local cache when requested. The default budget is 32 MB.
+     *
+     * This function can be called at any time.
+     *
+     * @param bytes Memory budget in bytes, or 0 for no limit.
+     */
+    void setRamHistoryBudget(long long bytes);
+
     /**
      * @brief Initializes karere
      *
@@ -56,7 +56,7 @@ using namespace chatd;
 LoggerHandler *MegaChatApiImpl::loggerHandler = NULL;
 
 MegaChatApiImpl::MegaChatApiImpl(MegaChatApi *chatApi, MegaApi *megaApi)
-: sdkMutex(true), localVideoReceiver(nullptr)
+: sdkMutex(true), timerWheel(this), localVideoReceiver(nullptr)
 {
     init(chatApi, megaApi);
 }
@@ -88,6 +88,9 @@ void MegaChatApiImpl::init(MegaChatApi *chatApi, MegaApi *megaApi)
 
     this->mClient = NULL;
     this->terminating = false;
+    this->mDecryptThreads = 0;
+    this->mPersistSymmKeys = false;
+    this->mRamHistoryBudget = chatd::Client::kDefaultRamHistoryBudget;
     this->waiter = new MegaChatWaiter();
     this->websocketsIO = new MegaWebsocketsIO(&sdkMutex, waiter, this);
     
@@ -157,8 +160,11 @@ void MegaChatApiImpl::megaApiPostMessage(void* msg, void* ctx)
 
 void MegaChatApiImpl::postMessage(void *msg)
 {
-    eventQueue.push(msg);
-    waiter->notify();
+    // wake up the loop only once for a burst of messages
+    if (eventQueue.push(msg))
+    {
+        waiter->notify();
+    }
 }
 
 void MegaChatApiImpl::sendPendingRequests()
@@ -296,6 +302,7 @@ void MegaChatApiImpl::sendPendingRequests()
 
                 delete mClient;
                 mClient = NULL;
+                clearChatListSnapshot();
                 terminating = false;
             }, this);
             break;
@@ -309,6 +316,7 @@ void MegaChatApiImpl::sendPendingRequests()
 
                 delete mClient;
                 mClient = NULL;
+                clearChatListSnapshot();
             }
 
             threadExit = 1;
@@ -939,12 +947,48 @@ void MegaChatApiImpl::setLoggerClass(MegaChatLogger *megaLogger)
     }
 }
 
+void MegaChatApiImpl::setDecryptThreads(int count)
+{
+    sdkMutex.lock();
+    mDecryptThreads = (count > 0) ? count : 0;
+    if (mClient)
+    {
+        mClient->setDecryptThreads(mDecryptThreads);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setPersistSymmKeys(bool enable)
+{
+    sdkMutex.lock();
+    mPersistSymmKeys = enable;
+    if (mClient)
+    {
+        mClient->setPersistSymmKeys(enable);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setRamHistoryBudget(long long bytes)
+{
+    sdkMutex.lock();
+    mRamHistoryBudget = (bytes > 0) ? bytes : 0;
+    if (mClient)
+    {
+        mClient->setRamHistoryBudget(mRamHistoryBudget);
+    }
+    sdkMutex.unlock();
+}
+
 int MegaChatApiImpl::init(const char *sid)
 {
     sdkMutex.lock();
     if (!mClient)
     {
         mClient = new karere::Client(*this->megaApi, websocketsIO, *this, this->megaApi->getBasePath(), karere::kClientIsMobile, this);
+        mClient->setDecryptThreads(mDecryptThreads);
+        mClient->setPersistSymmKeys(mPersistSymmKeys);
+        mClient->setRamHistoryBudget(mRamHistoryBudget);
         terminating = false;
     }
 
@@ -1268,8 +1312,32 @@ void MegaChatApiImpl::fireOnMessageUpdate(MegaChatMessage *msg)
     delete msg;
 }
 
+std::shared_ptr<const MegaChatApiImpl::ChatListSnapshot> MegaChatApiImpl::chatListSnapshot() const
+{
+    return mChatList.get();
+}
+
+void MegaChatApiImpl::publishChatListItem(MegaChatHandle chatid, const MegaChatListItem *item)
+{
+    // Only the karere thread publishes snapshots, so there are no concurrent writers
+    std::shared_ptr<MegaChatListItemPrivate> copy;
+    if (item)
+    {
+        copy = std::make_shared<MegaChatListItemPrivate>(item);
+        copy->clearChanges();
+    }
+    mChatList.publish(chatid, copy);
+}
+
+void MegaChatApiImpl::clearChatListSnapshot()
+{
+    mChatList.clear();
+}
+
 void MegaChatApiImpl::fireOnChatListItemUpdate(MegaChatListItem *item)
 {
+    // publish first, so that listeners get the updated item from the getters
+    publishChatListItem(item->getChatId(), item);
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
     {
         (*it)->onChatListItemUpdate(chatApi, item);
@@ -1652,58 +1720,53 @@ MegaChatRoom *MegaChatApiImpl::getChatRoomByUser(MegaChatHandle userhandle)
     return chat;
 }
 
+// The chat list getters don't take sdkMutex, but use the latest snapshot of
+// the chat list published by the karere thread
+
 MegaChatListItemList *MegaChatApiImpl::getChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    ChatRoomList::iterator it;
-    for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+    auto snapshot = chatListSnapshot();
+    if (snapshot)
     {
-        items->addChatListItem(new MegaChatListItemPrivate(*it->second));
+        for (auto& item: snapshot->items)
+        {
+            items->addChatListItem(new MegaChatListItemPrivate(item.second.get()));
+        }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
 MegaChatListItem *MegaChatApiImpl::getChatListItem(MegaChatHandle chatid)
 {
-    MegaChatListItemPrivate *item = NULL;
-
-    sdkMutex.lock();
-
-    ChatRoom *chatRoom = findChatRoom(chatid);
-    if (chatRoom)
+    auto snapshot = chatListSnapshot();
+    if (!snapshot)
     {
-        item = new MegaChatListItemPrivate(*chatRoom);
+        return NULL;
     }
 
-    sdkMutex.unlock();
-
-    return item;
+    auto it = snapshot->items.find(chatid);
+    return (it != snapshot->items.end()) ? new MegaChatListItemPrivate(it->second.get()) : NULL;
 }
 
 int MegaChatApiImpl::getUnreadChats()
 {
     int count = 0;
 
-    sdkMutex.lock();
-
-    ChatRoomList::iterator it;
-    for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+    auto snapshot = chatListSnapshot();
+    if (snapshot)
     {
-        ChatRoom *room = it->second;
-        if (room->isActive() && room->chat().unreadMsgCount())
+        for (auto& item: snapshot->items)
         {
-            count++;
+            if (item.second->isActive() && item.second->getUnreadCount())
+            {
+                count++;
+            }
         }
     }
 
-    sdkMutex.unlock();
-
     return count;
 }
 
@@ -1711,19 +1774,18 @@ MegaChatListItemList *MegaChatApiImpl::getActiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    ChatRoomList::iterator it;
-    for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+    auto snapshot = chatListSnapshot();
+    if (snapshot)
     {
-        if (it->second->isActive())
+        for (auto& item: snapshot->items)
         {
-            items->addChatListItem(new MegaChatListItemPrivate(*it->second));
+            if (item.second->isActive())
+            {
+                items->addChatListItem(new MegaChatListItemPrivate(item.second.get()));
+            }
         }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
@@ -1731,19 +1793,18 @@ MegaChatListItemList *MegaChatApiImpl::getInactiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    ChatRoomList::iterator it;
-    for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+    auto snapshot = chatListSnapshot();
+    if (snapshot)
     {
-        if (!it->second->isActive())
+        for (auto& item: snapshot->items)
         {
-            items->addChatListItem(new MegaChatListItemPrivate(*it->second));
+            if (!item.second->isActive())
+            {
+                items->addChatListItem(new MegaChatListItemPrivate(item.second.get()));
+            }
         }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
@@ -1751,20 +1812,18 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    ChatRoomList::iterator it;
-    for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+    auto snapshot = chatListSnapshot();
+    if (snapshot)
     {
-        ChatRoom *room = it->second;
-        if (room->isActive() && room->chat().unreadMsgCount())
+        for (auto& item: snapshot->items)
         {
-            items->addChatListItem(new MegaChatListItemPrivate(*it->second));
+            if (item.second->isActive() && item.second->getUnreadCount())
+            {
+                items->addChatListItem(new MegaChatListItemPrivate(item.second.get()));
+            }
         }
     }
 
-    sdkMutex.unlock();
-
     return items;
 }
 
@@ -1936,6 +1995,14 @@ MegaChatMessage *MegaChatApiImpl::getMessage(MegaChatHandle chatid, MegaChatHand
             {
                 megaMsg = new MegaChatMessagePrivate(*msg, chat.getMsgStatus(*msg, index), index);
             }
+            else if (index < chat.lownum())   // evicted from RAM, but still in db
+            {
+                std::unique_ptr<Message> evicted(chat.loadEvictedMsg(index));
+                if (evicted)
+                {
+                    megaMsg = new MegaChatMessagePrivate(*evicted, chat.getMsgStatus(*evicted, index), index);
+                }
+            }
             else
             {
                 API_LOG_ERROR("Failed to find message by index, being index retrieved from message id (index: %d, id: %d)", index, msgid);
@@ -2161,12 +2228,14 @@ MegaChatMessage *MegaChatApiImpl::editMessage(MegaChatHandle chatid, MegaChatHan
     {
         Chat &chat = chatroom->chat();
         Message *originalMsg = findMessage(chatid, msgid);
-        Idx index;
-        if (originalMsg)
+        std::unique_ptr<Message> evictedMsg;
+        Idx index = chat.msgIndexFromId(msgid);
+        if (!originalMsg && index != CHATD_IDX_INVALID)   // evicted from RAM, but still in db
         {
-            index = chat.msgIndexFromId(msgid);
+            evictedMsg.reset(chat.loadEvictedMsg(index));
+            originalMsg = evictedMsg.get();
         }
-        else   // message may not have an index yet (not confirmed)
+        if (!originalMsg)   // message may not have an index yet (not confirmed)
         {
             index = MEGACHAT_INVALID_INDEX;
             originalMsg = findMessageNotConfirmed(chatid, msgid);   // find by transactional id
@@ -2629,6 +2698,7 @@ void MegaChatApiImpl::removeGroupChatItem(IGroupChatListItem &item)
         IGroupChatListItem *itemHandler = (*it);
         if (itemHandler == &item)
         {
+            publishChatListItem((*it)->getChatRoom().chatid(), NULL);
 //            TODO: Redmine ticket #5693
 //            MegaChatListItemPrivate *listItem = new MegaChatListItemPrivate((*it)->getChatRoom());
 //            listItem->setClosed();
@@ -2651,6 +2721,7 @@ void MegaChatApiImpl::removePeerChatItem(IPeerChatListItem &item)
         IPeerChatListItem *itemHandler = (*it);
         if (itemHandler == &item)
         {
+            publishChatListItem((*it)->getChatRoom().chatid(), NULL);
 //            TODO: Redmine ticket #5693
 //            MegaChatListItemPrivate *listItem = new MegaChatListItemPrivate((*it)->getChatRoom());
 //            listItem->setClosed();
@@ -2733,61 +2804,6 @@ void ChatRequestQueue::removeListener(MegaChatRequestListener *listener)
     mutex.unlock();
 }
 
-EventQueue::EventQueue()
-{
-    mutex.init(false);
-}
-
-void EventQueue::push(void *transfer)
-{
-    mutex.lock();
-    events.push_back(transfer);
-    mutex.unlock();
-}
-
-void EventQueue::push_front(void *event)
-{
-    mutex.lock();
-    events.push_front(event);
-    mutex.unlock();
-}
-
-void* EventQueue::pop()
-{
-    mutex.lock();
-    if(events.empty())
-    {
-        mutex.unlock();
-        return NULL;
-    }
-    void* event = events.front();
-    events.pop_front();
-    mutex.unlock();
-    return event;
-}
-
-bool EventQueue::isEmpty()
-{
-    bool ret;
-
-    mutex.lock();
-    ret = events.empty();
-    mutex.unlock();
-
-    return ret;
-}
-
-size_t EventQueue::size()
-{
-    size_t ret;
-
-    mutex.lock();
-    ret = events.size();
-    mutex.unlock();
-
-    return ret;
-}
-
 MegaChatRequestPrivate::MegaChatRequestPrivate(int type, MegaChatRequestListener *listener)
 {
     this->type = type;
@@ -4298,6 +4314,11 @@ void MegaChatListItemPrivate::setLastTimestamp(int64_t ts)
     this->changed |= MegaChatListItem::CHANGE_TYPE_LAST_TS;
 }
 
+void MegaChatListItemPrivate::clearChanges()
+{
+    this->changed = 0;
+}
+
 void MegaChatListItemPrivate::setLastMessage(MegaChatHandle messageId, int type, const string &msg, const uint64_t uh)
 {
     this->lastMsg = msg;
@@ -40,10 +40,13 @@
 //#include <mstrophepp.h>
 #include <karereCommon.h>
 #include <logger.h>
+#include <eventQueue.h>
+#include <snapshotMap.h>
 
 #include "net/websocketsIO.h"
 
 #include <stdint.h>
+#include <atomic>
 
 #ifdef USE_LIBWEBSOCKETS
 
@@ -280,6 +283,7 @@ public:
     void setMembersUpdated();
     void setClosed();
     void setLastTimestamp(int64_t ts);
+    void clearChanges();
 
     /**
      * If the message is of type MegaChatMessage::TYPE_ATTACHMENT, this function
@@ -636,22 +640,6 @@ class ChatRequestQueue
         void removeListener(MegaChatRequestListener *listener);
 };
 
-//Thread safe transfer queue
-class EventQueue
-{
-protected:
-    std::deque<void *> events;
-    mega::MegaMutex mutex;
-
-public:
-    EventQueue();
-    void push(void* event);
-    void push_front(void *event);
-    void* pop();
-    bool isEmpty();
-    size_t size();
-};
-
 class MegaChatApiImpl :
         public karere::IApp,
         public karere::IApp::IChatListHandler
@@ -663,12 +651,30 @@ public:
 
     mega::MegaMutex sdkMutex;
     mega::Waiter *waiter;
+    /** Timers set with this instance as app context. Accessed by the karere
+     * thread, or with sdkMutex held */
+    karere::TimerWheel timerWheel;
+
+    /** @brief An immutable snapshot of the chat list items. A new one is
+     * published by the karere thread every time an item changes, and the read
+     * accessors of the chat list use the latest one without taking sdkMutex */
+    typedef karere::SnapshotMap<MegaChatHandle, MegaChatListItemPrivate>::Snapshot ChatListSnapshot;
 private:
     MegaChatApi *chatApi;
     mega::MegaApi *megaApi;
     WebsocketsIO *websocketsIO;
     karere::Client *mClient;
     bool terminating;
+    /** Settings of the karere client, applied when it's created */
+    unsigned mDecryptThreads;
+    bool mPersistSymmKeys;
+    size_t mRamHistoryBudget;
+    karere::SnapshotMap<MegaChatHandle, MegaChatListItemPrivate> mChatList;
+    std::shared_ptr<const ChatListSnapshot> chatListSnapshot() const;
+    /** @brief Publishes a snapshot where the item of the chat is replaced
+     * by \c item, or removed if \c item is null */
+    void publishChatListItem(MegaChatHandle chatid, const MegaChatListItem *item);
+    void clearChatListSnapshot();
 
     mega::MegaThread thread;
     int threadExit;
@@ -680,7 +686,7 @@ private:
     static LoggerHandler *loggerHandler;
 
     ChatRequestQueue requestQueue;
-    EventQueue eventQueue;
+    karere::EventQueue eventQueue;
 
     std::set<MegaChatListener *> listeners;
     std::set<MegaChatRoomListener *> roomListeners;
@@ -714,6 +720,9 @@ public:
     static void setLogWithColors(bool useColors);
     static void setLogToConsole(bool enable);
 
+    void setDecryptThreads(int count);
+    void setPersistSymmKeys(bool enable);
+    void setRamHistoryBudget(long long bytes);
     int init(const char *sid);
     int getInitState();
 
@@ -10,28 +10,50 @@ using namespace std;
 LibwsIO::LibwsIO(::mega::Mutex *mutex, ::mega::Waiter* waiter, void *ctx) : WebsocketsIO(mutex, ctx)
 {
     ::mega::LibeventWaiter *libeventWaiter = dynamic_cast<::mega::LibeventWaiter *>(waiter);
-    ws_global_init(&wscontext, libeventWaiter ? libeventWaiter->eventloop : services_get_event_loop(), NULL,
-    [](struct bufferevent* bev, void* userp)
+    if (libeventWaiter)
     {
-        karere::marshallCall([bev, userp]()
+        // The libevent loop is run by the waiter, in the same thread that processes
+        // the marshalled calls, so the socket callbacks can be called directly
+        // without allocating and posting a message for every read
+        ws_global_init(&wscontext, libeventWaiter->eventloop, NULL,
+        [](struct bufferevent* bev, void* userp)
         {
             ws_read_callback(bev, userp);
-        }, NULL);
-    },
-    [](struct bufferevent* bev, short events, void* userp)
-    {
-        karere::marshallCall([bev, events, userp]()
+        },
+        [](struct bufferevent* bev, short events, void* userp)
         {
             ws_event_callback(bev, events, userp);
-        }, NULL);
-    },
-    [](int fd, short events, void* userp)
-    {
-        karere::marshallCall([events, userp]()
+        },
+        [](int fd, short events, void* userp)
         {
             ws_handle_marshall_timer_cb(0, events, userp);
-        }, NULL);
-    });
+        });
+    }
+    else
+    {
+        ws_global_init(&wscontext, services_get_event_loop(), NULL,
+        [](struct bufferevent* bev, void* userp)
+        {
+            karere::marshallCall([bev, userp]()
+            {
+                ws_read_callback(bev, userp);
+            }, NULL);
+        },
+        [](struct bufferevent* bev, short events, void* userp)
+        {
+            karere::marshallCall([bev, events, userp]()
+            {
+                ws_event_callback(bev, events, userp);
+            }, NULL);
+        },
+        [](int fd, short events, void* userp)
+        {
+            karere::marshallCall([events, userp]()
+            {
+                ws_handle_marshall_timer_cb(0, events, userp);
+            }, NULL);
+        });
+    }
     //ws_set_log_level(LIBWS_TRACE);
 }
 
@@ -156,19 +178,37 @@ void LibwsClient::websockMsgCb(ws_t ws, char *msg, uint64_t len, int binary, voi
     LibwsClient* self = static_cast<LibwsClient*>(arg);
     assert (ws == self->mWebSocket);
 
-    string data;
-    data.assign(msg, (size_t)len);
-    
+    // Messages received in the same burst are delivered by a single marshalled call
+    self->mPendingMsgs.emplace_back(msg, (size_t)len);
+    if (self->mPendingMsgs.size() > 1)
+    {
+        return;
+    }
+
     auto wptr = self->getDelTracker();
-    karere::marshallCall([self, wptr, data]()
+    karere::marshallCall([self, wptr]()
     {
         if (wptr.deleted())
             return;
-        
-        self->wsHandleMsgCb((char *)data.data(), data.size());
+
+        self->processPendingMsgs();
     }, self->appCtx);
 }
-                         
+
+void LibwsClient::processPendingMsgs()
+{
+    std::vector<std::string> msgs;
+    msgs.swap(mPendingMsgs);
+
+    auto wptr = getDelTracker();
+    for (auto& data: msgs)
+    {
+        wsHandleMsgCb((char *)data.data(), data.size());
+        if (wptr.deleted())
+            return;
+    }
+}
+
 bool LibwsClient::wsSendMessage(char *msg, size_t len)
 {
     assert (mWebSocket);
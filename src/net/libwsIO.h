@@ -5,6 +5,8 @@
 #include "net/websocketsIO.h"
 #include "trackDelete.h"
 #include <mega/waiter.h>
+#include <string>
+#include <vector>
 
 // Websockets network layer implementation based on libws
 class LibwsIO : public WebsocketsIO
@@ -38,6 +40,12 @@ public:
     virtual bool wsSendMessage(char *msg, size_t len);
     virtual void wsDisconnect(bool immediate);
     virtual bool wsIsConnected();
+
+protected:
+    // Received messages not yet delivered to the client. They are delivered in a
+    // single marshalled call, which is posted only when the first one arrives
+    std::vector<std::string> mPendingMsgs;
+    void processPendingMsgs();
 };
 
 #endif /* libwsIO_h */
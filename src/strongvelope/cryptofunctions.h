@@ -84,43 +84,34 @@ static inline void aesCBCDecrypt(const StaticBuffer& cipherText,
 
 //CTR mode is used for message content
 
-//can't use binary buffers here, libsodium doesn't support them for CTR mode
-static inline std::string aesCTREncrypt(const std::string& text,
-                        const StaticBuffer& derivedkey, const StaticBuffer& iv)
-{
-    assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption encryptor;
-    std::string cipher;
-    encryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
-    // The StreamTransformationFilter adds padding
-    //  as required. ECB and CBC Mode must be padded
-    //  to the block size of the cipher. CTR does not.
-    CryptoPP::StringSource s(text, true,
-        new CryptoPP::StreamTransformationFilter(encryptor,
-            new CryptoPP::StringSink(cipher)
-        ) // StreamTransformationFilter
-    ); // StringSource
-    return cipher;
-}
-
-static inline std::string aesCTRDecrypt(const std::string& ciphertext,
-                            const StaticBuffer& derivedkey, const StaticBuffer& iv)
+/** @brief AES-128-CTR encryption/decryption directly between binary buffers.
+ * CTR is a stream cipher mode, so encryption and decryption are the same
+ * operation, the data can be processed in consecutive chunks of any size,
+ * and the output may be the same memory as the input.
+ */
+class AesCtr
 {
-    CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption decryptor;
-    std::string text;
-    assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    decryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
-    // The StreamTransformationFilter adds padding
-    //  as required. ECB and CBC Mode must be padded
-    //  to the block size of the cipher. CTR does not.
-    CryptoPP::StringSource s(ciphertext, true,
-        new CryptoPP::StreamTransformationFilter(decryptor,
-            new CryptoPP::StringSink(text)
-        ) // StreamTransformationFilter
-    ); // StringSource
-    return text;
-}
+protected:
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption mCipher;
+public:
+    AesCtr(const StaticBuffer& derivedkey, const StaticBuffer& iv)
+    {
+        assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
+        assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
+        mCipher.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
+    }
+    /** @brief Restarts the key stream with a new IV, reusing the expanded key */
+    void setIV(const StaticBuffer& iv)
+    {
+        assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
+        mCipher.Resynchronize(iv.ubuf(), (int)iv.dataSize());
+    }
+    void process(const void* input, void* output, size_t len)
+    {
+        mCipher.ProcessData(static_cast<unsigned char*>(output), static_cast<const unsigned char*>(input), len);
+    }
+    /** @brief Processes the buffer contents in place */
+    void process(StaticBuffer& buf) { process(buf.buf(), buf.buf(), buf.dataSize()); }
+};
 
 }
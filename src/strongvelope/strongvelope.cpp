@@ -31,6 +31,7 @@
 #include <codecvt>
 #include <locale>
 #include <karereCommon.h>
+#include <base/gcmpp.h>
 
 namespace strongvelope
 {
@@ -41,6 +42,7 @@ using namespace chatd;
 
 const std::string PAIRWISE_KEY = "strongvelope pairwise key";
 const std::string PAIRWISE_KEY_WITH_SEP = PAIRWISE_KEY+(char)0x01u;
+const std::string SYMMKEY_CACHE_KEY = "strongvelope pairwise key cache";
 const std::string SVCRYPTO_SIG = "strongvelopesig";
 const karere::Id API_USER("gTxFhlOd_LQ");
 void deriveNonceSecret(const StaticBuffer& masterNonce, const StaticBuffer &result,
@@ -86,19 +88,19 @@ EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
 
     size_t brsize = msg.backRefs.size()*8;
     size_t binsize = 10+brsize;
-    Buffer buf(binsize+msg.dataSize());
-    buf.append<uint64_t>(msg.backRefId)
+    ciphertext.reserve(binsize+msg.dataSize());
+    ciphertext.append<uint64_t>(msg.backRefId)
        .append<uint16_t>(brsize);
     if (brsize)
     {
-        buf.append((const char*)(&msg.backRefs[0]), brsize);
+        ciphertext.append((const char*)msg.backRefs.data(), brsize);
     }
     if (!msg.empty())
     {
-        buf.append(msg);
+        ciphertext.append(msg);
     }
-    ciphertext = aesCTREncrypt(std::string(buf.buf(), buf.dataSize()),
-        key, derivedNonce);
+    // encrypt the assembled plaintext in place
+    AesCtr(key, derivedNonce).process(ciphertext);
 }
 
 /**
@@ -107,14 +109,13 @@ EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
  * @param key Symmetric encryption key.
  * @param outMsg The message object to write the decrypted data to.
  */
-void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
+void ParsedMessage::symmetricDecrypt(const SendKey& key, Message& outMsg)
 {
     if (payload.empty())
     {
         outMsg.clear();
         return;
     }
-    Id chatid = mProtoHandler.chatid;
     STRONGVELOPE_LOG_DEBUG("Decrypting msg %s", outMsg.id().toString().c_str());
     Key<32> derivedNonce;
     // deriveNonceSecret() needs at least 32 bytes output buffer
@@ -123,12 +124,71 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     // For AES CRT mode, we take the first 12 bytes as the nonce,
     // and the remaining 4 bytes as the counter, which is initialized to zero
     *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0;
-    std::string cleartext = aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
-        key, derivedNonce);
-    parsePayload(StaticBuffer(cleartext, false), outMsg);
+    AesCtr& cipher = key.ctrCipher(derivedNonce);
+    if (protocolVersion < 3)
+    {
+        // the utf8-encoded backrefs can only be parsed from the whole plaintext
+        Buffer cleartext(payload.dataSize());
+        cipher.process(payload.buf(), cleartext.writePtr(0, payload.dataSize()), payload.dataSize());
+        parsePayload(cleartext, outMsg);
+    }
+    else
+    {
+        decryptPayload(cipher, outMsg);
+    }
+    // The message buffer may still have the capacity of the ciphertext, and will
+    // stay in the history buffer for a long time
+    outMsg.shrinkToFit();
     outMsg.setEncrypted(0);
 }
 
+/**
+ * Decrypts the payload, parsing the backrefs header on the fly, and writes
+ * the message contents directly to the message buffer, without an
+ * intermediate plaintext copy. Equivalent to decrypting the payload and
+ * calling \c parsePayload() with the result.
+ */
+void ParsedMessage::decryptPayload(AesCtr& cipher, Message& msg)
+{
+    const char* data = payload.buf();
+    size_t len = payload.dataSize();
+    if (len < 10)
+        throw std::runtime_error("parsePayload: payload is less than backrefs minimum size");
+
+    char header[10];
+    cipher.process(data, header, 10);
+    StaticBuffer hdr(header, 10);
+    msg.backRefId = hdr.read<uint64_t>(0);
+    uint16_t refsSize = hdr.read<uint16_t>(8);
+    size_t binsize = 10+refsSize;
+    if (len < binsize)
+        throw std::runtime_error("parsePayload: Payload size "+std::to_string(len)+" is less than size of backrefs "+std::to_string(binsize));
+
+    assert(msg.backRefs.empty());
+    msg.backRefs.reserve(refsSize/8);
+    size_t pos = 10;
+    for (; pos+sizeof(uint64_t) <= binsize; pos += sizeof(uint64_t))
+    {
+        uint64_t refid;
+        cipher.process(data+pos, &refid, sizeof(refid));
+        msg.backRefs.push_back(refid);
+    }
+    if (pos < binsize) //refsSize is not a multiple of 8, skip the rest
+    {
+        char skip[sizeof(uint64_t)];
+        cipher.process(data+pos, skip, binsize-pos);
+    }
+
+    // The message buffer contains the ciphertext, we don't need it anymore.
+    // Freeing it lets short messages go to the inline storage
+    msg.free();
+    if (len > binsize)
+    {
+        size_t textLen = len-binsize;
+        cipher.process(data+binsize, msg.writePtr(0, textLen), textLen);
+    }
+}
+
 /**
  * Derive the nonce to use for an encryption for a particular recipient
  * or message payload encryption.
@@ -149,14 +209,22 @@ void deriveNonceSecret(const StaticBuffer& masterNonce, const StaticBuffer& resu
                        Id recipient)
 {
     result.checkDataSize(32);
-    Buffer recipientStr;
+    // Equivalent to first block of HKDF, see RFC 5869.
+    // The HMAC is keyed with the master nonce, which is unique per message,
+    // so there is no keyed state to reuse across messages
     if (recipient == Id::null())
-        recipientStr.append(std::string("payload"));
+        hmac_sha256_bytes(StaticBuffer("payload", 7), masterNonce, result);
     else
-        recipientStr.append(recipient.val);
+        hmac_sha256_bytes(StaticBuffer((const char*)&recipient.val, sizeof(recipient.val)), masterNonce, result);
+}
 
-    // Equivalent to first block of HKDF, see RFC 5869.
-    hmac_sha256_bytes(recipientStr, masterNonce, result);
+AesCtr& SendKey::ctrCipher(const StaticBuffer& iv) const
+{
+    if (!mCtrCipher)
+        mCtrCipher = std::make_shared<AesCtr>(*this, iv);
+    else
+        mCtrCipher->setIV(iv);
+    return *mCtrCipher;
 }
 
 void ProtocolHandler::signMessage(const StaticBuffer& signedData,
@@ -180,7 +248,12 @@ void ProtocolHandler::signMessage(const StaticBuffer& signedData,
         toSign.dataSize(), key.ubuf());
 }
 
-bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey)
+/**
+ * Messages are verified one by one: libsodium has no batch Ed25519 verify, and
+ * emulating one with its public group operations is slower than verifying
+ * individually. The decrypt pool, when enabled, verifies messages in parallel.
+ */
+bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey) const
 {
     assert(pubKey.dataSize() == 32);
     if (protocolVersion < 2)
@@ -223,20 +296,21 @@ bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& s
  *     result of the group key agreement.
  * @param output Output buffer for result.
  */
-void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output)
+void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output,
+    const std::string& info=PAIRWISE_KEY)
 {
     assert(output.dataSize() == AES::BLOCKSIZE);
     // Equivalent to first block of HKDF, see RFC 5869.
     Key<32> sharedSecretKey;
     hmac_sha256_bytes(sharedSecret, StaticBuffer(nullptr, 0), sharedSecretKey); //step 1 - extract
-    std::string infoStr = PAIRWISE_KEY+(char)0x01u; //For efficiency the 0x01u can be appended to the constant definition itself
+    std::string infoStr = info+(char)0x01u; //For efficiency the 0x01u can be appended to the constant definition itself
     Key<32> step2;
     hmac_sha256_bytes(StaticBuffer(infoStr, false), sharedSecretKey, step2); //step 2 - expand
     memcpy(output.buf(), step2.buf(), AES::BLOCKSIZE);
 }
 
 ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& protoHandler)
-: mProtoHandler(protoHandler)
+: mProtoHandler(protoHandler), chatid(protoHandler.chatid)
 {
     if(binaryMessage.empty())
     {
@@ -372,7 +446,6 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
     if (!recordNames.empty())
     {
         recordNames.resize(recordNames.size()-2);
-        Id chatid = protoHandler.chatid;
         STRONGVELOPE_LOG_DEBUG("msg %s: read %s",
             binaryMessage.id().toString().c_str(), recordNames.c_str());
     }
@@ -380,7 +453,6 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
 
 void ParsedMessage::parsePayloadWithUtfBackrefs(const StaticBuffer &data, Message &msg)
 {
-    Id chatid = mProtoHandler.chatid;
     if (data.empty())
     {
         STRONGVELOPE_LOG_DEBUG("Empty message payload");
@@ -446,6 +518,54 @@ void ParsedMessage::parsePayload(const StaticBuffer &data, Message &msg)
     }
 }
 
+DecryptPool::DecryptPool(unsigned threadCount)
+{
+    assert(threadCount);
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        mThreads.emplace_back(&DecryptPool::run, this);
+    }
+}
+
+DecryptPool::~DecryptPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mTerminating = true;
+    }
+    mCondVar.notify_all();
+    for (auto& thread: mThreads)
+    {
+        thread.join();
+    }
+}
+
+void DecryptPool::post(Job&& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mJobs.push_back(std::move(job));
+    }
+    mCondVar.notify_one();
+}
+
+void DecryptPool::run()
+{
+    for (;;)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondVar.wait(lock, [this]() { return mTerminating || !mJobs.empty(); });
+            if (mTerminating)
+                return;
+            job = std::move(mJobs.front());
+            mJobs.pop_front();
+        }
+        job();
+    }
+}
+
 ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     const StaticBuffer& privCu25519,
     const StaticBuffer& privEd25519,
@@ -453,10 +573,10 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     karere::UserAttrCache& userAttrCache, SqliteDb &db, Id aChatId, void *ctx)
 : chatd::ICrypto(ctx), mOwnHandle(ownHandle), myPrivCu25519(privCu25519),
  myPrivEd25519(privEd25519), myPrivRsaKey(privRsa),
- mUserAttrCache(userAttrCache), mDb(db), chatid(aChatId)
+ mUserAttrCache(userAttrCache), mDb(db),
+ mSymmKeyCache(std::make_shared<SymmKeyCache>(nullptr, privCu25519)), chatid(aChatId)
 {
     getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
-    loadKeysFromDb();
     auto var = getenv("KRCHAT_FORCE_RSA");
     if (var)
     {
@@ -465,24 +585,60 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     }
 }
 
-void ProtocolHandler::loadKeysFromDb()
+std::shared_ptr<SendKey> ProtocolHandler::loadKeyFromDb(UserKeyId ukid)
 {
-//    int oldest = time(NULL)-CHATD_MAX_EDIT_AGE-600;
-    SqliteStmt stmt(mDb, "select userid, keyid, key from sendkeys where chatid=?");
-    stmt << chatid;
-    while(stmt.step())
-    {
-        auto key = std::make_shared<SendKey>();
-        stmt.blobCol(2, *key);
-#ifndef NDEBUG
-        auto ret =
-#endif
-        mKeys.emplace(std::piecewise_construct,
-            std::forward_as_tuple(stmt.uint64Col(0), stmt.uint64Col(1)),
-            std::forward_as_tuple(key));
-        assert(ret.second);
+    SqliteStmt stmt(mDb, "select key from sendkeys where chatid=? and userid=? and keyid=?");
+    stmt << chatid << ukid.user << ukid.key;
+    if (!stmt.step())
+        return nullptr;
+
+    auto key = std::make_shared<SendKey>();
+    stmt.blobCol(0, *key);
+    return key;
+}
+
+ProtocolHandler::KeyEntry& ProtocolHandler::getKeyEntry(UserKeyId ukid)
+{
+    auto it = mKeys.find(ukid);
+    if (it != mKeys.end())
+        return it->second;
+
+    auto& entry = mKeys[ukid];
+    auto key = loadKeyFromDb(ukid);
+    if (key)
+    {
+        STRONGVELOPE_LOG_DEBUG("Loaded key %" PRId64 " of user %s from database", ukid.key, ukid.user.toString().c_str());
+        setEntryKey(ukid, entry, key);
+    }
+    return entry;
+}
+
+void ProtocolHandler::setEntryKey(UserKeyId ukid, KeyEntry& entry, const std::shared_ptr<SendKey>& key)
+{
+    assert(!entry.key);
+    entry.key = key;
+    mKeyLru.push_front(ukid);
+    entry.lruPos = mKeyLru.begin();
+    if (mKeyLru.size() > kMaxCachedKeys)
+        evictKeys();
+}
+
+void ProtocolHandler::evictKeys()
+{
+    // Start from the least recently used key. Entries with a pending promise
+    // are skipped, there is someone waiting on them. The most recent one is
+    // never evicted, it has just been added
+    auto it = mKeyLru.end();
+    while ((mKeyLru.size() > kMaxCachedKeys) && (it != std::next(mKeyLru.begin())))
+    {
+        --it;
+        auto kit = mKeys.find(*it);
+        assert(kit != mKeys.end());
+        if (kit->second.pms)
+            continue;
+        mKeys.erase(kit);
+        it = mKeyLru.erase(it);
     }
-    STRONGVELOPE_LOG_DEBUG("(%" PRId64 "): Loaded %zu send keys from database", chatid, mKeys.size());
 }
 
 void ProtocolHandler::msgEncryptWithKey(Message& src, chatd::MsgCommand& dest,
@@ -490,10 +646,10 @@ void ProtocolHandler::msgEncryptWithKey(Message& src, chatd::MsgCommand& dest,
 {
     EncryptedMessage encryptedMessage(src, key);
     assert(!encryptedMessage.ciphertext.empty());
-    TlvWriter tlv(encryptedMessage.ciphertext.size()+128); //only signed content goes here
+    TlvWriter tlv(encryptedMessage.ciphertext.dataSize()+128); //only signed content goes here
     // Assemble message content.
     tlv.addRecord(TLV_TYPE_NONCE, encryptedMessage.nonce);
-    tlv.addRecord(TLV_TYPE_PAYLOAD, StaticBuffer(encryptedMessage.ciphertext, false));
+    tlv.addRecord(TLV_TYPE_PAYLOAD, encryptedMessage.ciphertext);
     Key<64> signature;
     signMessage(tlv, SVCRYPTO_PROTOCOL_VERSION, SVCRYPTO_MSGTYPE_FOLLOWUP,
                 encryptedMessage.key, signature);
@@ -508,38 +664,118 @@ void ProtocolHandler::msgEncryptWithKey(Message& src, chatd::MsgCommand& dest,
     dest.updateMsgSize();
 }
 
-promise::Promise<std::shared_ptr<SendKey>>
-ProtocolHandler::computeSymmetricKey(karere::Id userid)
+SymmKeyCache::SymmKeyCache(SqliteDb* db, const StaticBuffer& privCu25519)
+: mDb(db)
 {
-    auto it = mSymmKeyCache.find(userid);
-    if (it != mSymmKeyCache.end())
+    if (mDb)
     {
-        return it->second;
+        deriveSharedKey(privCu25519, mDbKey, SYMMKEY_CACHE_KEY);
+    }
+}
+
+bool SymmKeyCache::loadFromDb(Id user, Entry& entry)
+{
+    SqliteStmt stmt(*mDb, "select pubkey, key from symkeys where userid=?");
+    stmt << user;
+    if (!stmt.step())
+        return false;
+
+    stmt.blobCol(0, entry.pubKey);
+    Key<16> encKey;
+    stmt.blobCol(1, encKey);
+    if ((entry.pubKey.dataSize() != entry.pubKey.bufSize()) || (encKey.dataSize() != AES::BLOCKSIZE))
+    {
+        KR_LOG_WARNING("SymmKeyCache: Invalid key of user %s in db, ignoring it", user.toString().c_str());
+        return false;
+    }
+    entry.key = std::make_shared<SendKey>();
+    aesECBDecrypt(encKey, mDbKey, *entry.key);
+    return true;
+}
+
+std::shared_ptr<SendKey> SymmKeyCache::get(Id user, const StaticBuffer& pubKey)
+{
+    auto it = mKeys.find(user);
+    if (it == mKeys.end())
+    {
+        if (!mDb)
+            return nullptr;
+        Entry entry;
+        if (!loadFromDb(user, entry))
+            return nullptr;
+        it = mKeys.emplace(user, entry).first;
+    }
+    auto& entry = it->second;
+    if (entry.pubKey.dataSize() == pubKey.dataSize()
+     && memcmp(entry.pubKey.buf(), pubKey.buf(), pubKey.dataSize()) == 0)
+    {
+        return entry.key;
+    }
+    // the peer's Cu25519 key has changed
+    remove(user);
+    return nullptr;
+}
+
+void SymmKeyCache::put(Id user, const StaticBuffer& pubKey, const std::shared_ptr<SendKey>& key)
+{
+    auto& entry = mKeys[user];
+    entry.pubKey.assign(pubKey.buf(), pubKey.dataSize());
+    entry.key = key;
+    if (!mDb)
+        return;
+
+    Key<16> encKey;
+    aesECBEncrypt(*key, mDbKey, encKey);
+    mDb->query("insert or replace into symkeys(userid, pubkey, key) values(?,?,?)",
+        user, entry.pubKey, encKey);
+}
+
+void SymmKeyCache::remove(Id user)
+{
+    mKeys.erase(user);
+    if (mDb)
+    {
+        mDb->query("delete from symkeys where userid=?", user);
     }
+}
+
+promise::Promise<std::shared_ptr<SendKey>>
+ProtocolHandler::computeSymmetricKey(karere::Id userid)
+{
+    // The pubkey is always obtained (normally from the attribute cache),
+    // to make sure that the cached key is still valid for it
     auto wptr = weakHandle();
     return mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
     .then([wptr, this, userid](const StaticBuffer* pubKey) -> promise::Promise<std::shared_ptr<SendKey>>
     {
         wptr.throwIfDeleted();
-        // We may have had 2 almost parallel requests, and the second may
-        // have put the key into the cache already
-        auto it = mSymmKeyCache.find(userid);
-        if (it != mSymmKeyCache.end())
-            return it->second;
-
         if (pubKey->empty())
             return promise::Error("Empty Cu25519 chat key for user "+userid.toString());
+
+        auto cached = mSymmKeyCache->get(userid, *pubKey);
+        if (cached)
+            return cached;
+
         Key<crypto_scalarmult_BYTES> sharedSecret;
         sharedSecret.setDataSize(crypto_scalarmult_BYTES);
         auto ignore = crypto_scalarmult(sharedSecret.ubuf(), myPrivCu25519.ubuf(), pubKey->ubuf());
         (void)ignore;
         auto result = std::make_shared<SendKey>();
         deriveSharedKey(sharedSecret, *result);
-        mSymmKeyCache.emplace(userid, result);
+        mSymmKeyCache->put(userid, *pubKey, result);
         return result;
     });
 }
 
+/** Encrypts a send key with the symmetric key shared with a participant */
+static std::shared_ptr<Buffer> wrapSendKey(const SendKey& sendKey, const SendKey& symKey)
+{
+    auto result = std::make_shared<Buffer>((size_t)AES::BLOCKSIZE);
+    result->setDataSize(AES::BLOCKSIZE); //dataSize() is used to check available buffer space of StaticBuffers
+    aesECBEncrypt(sendKey, symKey, *result);
+    return result;
+}
+
 Promise<std::shared_ptr<Buffer>>
 ProtocolHandler::encryptKeyTo(const std::shared_ptr<SendKey>& sendKey, karere::Id toUser)
 {
@@ -555,10 +791,7 @@ ProtocolHandler::encryptKeyTo(const std::shared_ptr<SendKey>& sendKey, karere::I
             return promise::Error("Test: Forcing RSA");
 
         assert(symkey->dataSize() == SVCRYPTO_KEY_SIZE);
-        auto result = std::make_shared<Buffer>((size_t)AES::BLOCKSIZE);
-        result->setDataSize(AES::BLOCKSIZE); //dataSize() is used to check available buffer space of StaticBuffers
-        aesECBEncrypt(*sendKey, *symkey, *result);
-        return result;
+        return wrapSendKey(*sendKey, *symkey);
     })
     .fail([wptr, this, toUser, sendKey](const promise::Error& err)
     {
@@ -852,6 +1085,10 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
         .then([this, wptr, message, parsedMsg, ctx, isLegacy, keyid]() ->promise::Promise<Message*>
         {
             wptr.throwIfDeleted();
+            if (mDecryptPool && !isLegacy)
+            {
+                return poolMsgDecrypt(parsedMsg, message, *ctx->sendKey, ctx->edKey);
+            }
             if (!parsedMsg->verifySignature(ctx->edKey, *ctx->sendKey))
             {
                 return promise::Error("Signature invalid for message "+
@@ -874,13 +1111,101 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
     }
 }
 
+void ProtocolHandler::runInPool(std::function<void()>&& work, std::function<void()>&& done)
+{
+    assert(mDecryptPool);
+    // The completion callback stays here, as it may hold objects that are not
+    // thread-safe, i.e. promises
+    auto id = mNextPoolJobId++;
+    mPoolCallbacks.emplace(id, std::move(done));
+    auto wptr = weakHandle();
+    auto ctx = appCtx;
+    auto job = std::make_shared<std::function<void()>>(std::move(work));
+    mDecryptPool->post([this, wptr, job, id, ctx]()
+    {
+        (*job)();
+        karere::marshallCall([this, wptr, id]()
+        {
+            if (wptr.deleted())
+                return;
+            auto it = mPoolCallbacks.find(id);
+            assert(it != mPoolCallbacks.end());
+            auto done = std::move(it->second);
+            mPoolCallbacks.erase(it);
+            done();
+        }, ctx);
+    });
+}
+
+Promise<Message*>
+ProtocolHandler::poolMsgDecrypt(const std::shared_ptr<ParsedMessage>& parsedMsg,
+    Message* message, const SendKey& sendKey, const EcKey& edKey)
+{
+    // Everything the worker needs is copied here, so that it doesn't access
+    // objects owned by the karere thread. The decrypted content goes to a
+    // temporary message, which is transferred to the real one when the
+    // result is marshalled back
+    struct Job
+    {
+        std::shared_ptr<ParsedMessage> parsedMsg;
+        SendKey sendKey;
+        EcKey edKey;
+        Message output;
+        bool sigValid = false;
+        std::string error;
+        Job(const std::shared_ptr<ParsedMessage>& aParsedMsg,
+            const SendKey& aSendKey, const EcKey& aEdKey, const Message& msg)
+        : parsedMsg(aParsedMsg), sendKey(aSendKey), edKey(aEdKey),
+          output(msg.id(), msg.userid, msg.ts, msg.updated, (const char*)nullptr, 0){}
+    };
+    auto job = std::make_shared<Job>(parsedMsg, sendKey, edKey, *message);
+    Promise<Message*> pms;
+    runInPool([job]()
+    {
+        try
+        {
+            job->sigValid = job->parsedMsg->verifySignature(job->edKey, job->sendKey);
+            if (job->sigValid)
+            {
+                job->parsedMsg->symmetricDecrypt(job->sendKey, job->output);
+            }
+        }
+        catch(std::exception& e)
+        {
+            job->error = e.what();
+        }
+    },
+    [job, message, pms]() mutable
+    {
+        if (!job->error.empty())
+        {
+            pms.reject(promise::Error(job->error));
+        }
+        else if (!job->sigValid)
+        {
+            pms.reject(promise::Error("Signature invalid for message "+
+                message->id().toString(), EINVAL, SVCRYPTO_ERRTYPE));
+        }
+        else
+        {
+            auto& output = job->output;
+            message->backRefId = output.backRefId;
+            message->backRefs = output.backRefs;
+            message->takeFrom(std::move(output));
+            message->setEncrypted(0);
+            pms.resolve(message);
+        }
+    });
+    return pms;
+}
+
 Promise<void>
 ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedMsg)
 {
     if (parsedMsg->encryptedKey.empty())
         return promise::Error("legacyExtractKeys: No encrypted keys found in parsed message", EPROTO, SVCRYPTO_ERRTYPE);
 
-    auto& key1 = mKeys[UserKeyId(parsedMsg->sender, parsedMsg->keyId)];
+    auto& key1 = getKeyEntry(UserKeyId(parsedMsg->sender, parsedMsg->keyId));
     if (!key1.key)
     {
         if (!key1.pms)
@@ -888,7 +1213,7 @@ ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedM
     }
     if (parsedMsg->prevKeyId)
     {
-        auto& key2 = mKeys[UserKeyId(parsedMsg->sender, parsedMsg->prevKeyId)];
+        auto& key2 = getKeyEntry(UserKeyId(parsedMsg->sender, parsedMsg->prevKeyId));
         if (!key2.key)
         {
             if (!key2.pms)
@@ -922,7 +1247,7 @@ void ProtocolHandler::onKeyReceived(uint32_t keyid, Id sender, Id receiver,
         addDecryptedKey(UserKeyId(sender, keyid), pms.value());
         return;
     }
-    auto& entry = mKeys[UserKeyId(sender, keyid)];
+    auto& entry = getKeyEntry(UserKeyId(sender, keyid));
     STRONGVELOPE_LOG_DEBUG("onKeyReceived: Created a key entry with promise for key %d of user %s", keyid, sender.toString().c_str());
     if (entry.pms)
     {
@@ -946,6 +1271,8 @@ void ProtocolHandler::onKeyReceived(uint32_t keyid, Id sender, Id receiver,
         assert(it != mKeys.end());
         assert(it->second.pms);
         it->second.pms->reject(err);
+        if (it->second.key)
+            mKeyLru.erase(it->second.lruPos);
         mKeys.erase(it);
         return err;
     });
@@ -955,7 +1282,7 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
 {
     assert(key->dataSize() == SVCRYPTO_KEY_SIZE);
     STRONGVELOPE_LOG_DEBUG("Adding key %lld of user %s", ukid.key, ukid.user.toString().c_str());
-    auto& entry = mKeys[ukid];
+    auto& entry = getKeyEntry(ukid);
     if (entry.key)
     {
         if (memcmp(entry.key->buf(), key->buf(), SVCRYPTO_KEY_SIZE))
@@ -965,7 +1292,7 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
     }
     else
     {
-        entry.key = key;
+        setEntryKey(ukid, entry, key);
         try
         {
             mDb.query("insert or ignore into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)",
@@ -989,6 +1316,12 @@ ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
     auto kit = mKeys.find(ukid);
     if (kit == mKeys.end())
     {
+        auto dbKey = loadKeyFromDb(ukid);
+        if (dbKey)
+        {
+            setEntryKey(ukid, mKeys[ukid], dbKey);
+            return dbKey;
+        }
         if (legacy)
         {
             auto& key = mKeys[ukid];
@@ -1005,6 +1338,7 @@ ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
     auto key = entry.key;
     if (key)
     {
+        mKeyLru.splice(mKeyLru.begin(), mKeyLru, entry.lruPos);
         return key;
     }
     else if (entry.pms)
@@ -1062,32 +1396,171 @@ ProtocolHandler::encryptKeyToAllParticipants(const std::shared_ptr<SendKey>& key
 {
     // Users and send key may change while we are getting pubkeys of current
     // users, so make a snapshot
-    auto keyCmd = new KeyCommand(Id::null());
     SetOfIds users = *mParticipants;
     if (extraUser)
     {
         users.insert(extraUser);
     }
-    std::vector<Promise<void>> promises;
-    promises.reserve(users.size());
-
-    for (auto& user: users)
+    // The encrypted keys are stored by user position, and added to the key
+    // command in user order, regardless of the order in which they are obtained
+    auto userList = std::make_shared<std::vector<Id>>(users.begin(), users.end());
+    auto encKeys = std::make_shared<std::vector<std::shared_ptr<Buffer>>>(userList->size());
+    Promise<void> pms;
+    if (mDecryptPool && !mForceRsa)
+    {
+        pms = poolEncryptKeyTo(key, userList, encKeys);
+    }
+    else
     {
-        auto pms = encryptKeyTo(key, user)
-        .then([keyCmd, user](const std::shared_ptr<Buffer>& encryptedKey)
+        std::vector<Promise<void>> promises;
+        promises.reserve(userList->size());
+        for (size_t i = 0; i < userList->size(); i++)
         {
-            assert(encryptedKey && !encryptedKey->empty());
-            keyCmd->addKey(user, encryptedKey->buf(), encryptedKey->dataSize());
-        });
-        promises.push_back(pms);
+            promises.push_back(encryptKeyTo(key, (*userList)[i])
+            .then([encKeys, i](const std::shared_ptr<Buffer>& encryptedKey)
+            {
+                (*encKeys)[i] = encryptedKey;
+            }));
+        }
+        pms = promise::when(promises);
     }
-    return promise::when(promises)
-    .then([keyCmd, key]()
+    return pms.then([userList, encKeys, key]()
     {
+        auto keyCmd = new KeyCommand(Id::null());
+        for (size_t i = 0; i < userList->size(); i++)
+        {
+            auto& encryptedKey = (*encKeys)[i];
+            assert(encryptedKey && !encryptedKey->empty());
+            keyCmd->addKey((*userList)[i], encryptedKey->buf(), encryptedKey->dataSize());
+        }
         return std::make_pair(keyCmd, key);
     });
 }
 
+Promise<void>
+ProtocolHandler::poolEncryptKeyTo(const std::shared_ptr<SendKey>& sendKey,
+    const std::shared_ptr<std::vector<Id>>& users,
+    const std::shared_ptr<std::vector<std::shared_ptr<Buffer>>>& encKeys)
+{
+    // The shared keys that are not cached yet are computed by the workers.
+    // They get copies of the keys, and each writes only its own result slots
+    struct Batch
+    {
+        SendKey sendKey;
+        EcKey privKey;
+        std::vector<size_t> userIdx;
+        std::vector<EcKey> pubKeys;
+        std::vector<std::shared_ptr<SendKey>> symKeys;
+        std::vector<std::shared_ptr<Buffer>> encKeys;
+        Batch(const SendKey& aSendKey, const EcKey& aPrivKey)
+        : sendKey(aSendKey), privKey(aPrivKey){}
+        void compute(size_t i)
+        {
+            Key<crypto_scalarmult_BYTES> sharedSecret;
+            sharedSecret.setDataSize(crypto_scalarmult_BYTES);
+            auto ignore = crypto_scalarmult(sharedSecret.ubuf(), privKey.ubuf(), pubKeys[i].ubuf());
+            (void)ignore;
+            auto symKey = std::make_shared<SendKey>();
+            deriveSharedKey(sharedSecret, *symKey);
+            encKeys[i] = wrapSendKey(sendKey, *symKey);
+            symKeys[i] = symKey;
+        }
+    };
+    auto batch = std::make_shared<Batch>(*sendKey, myPrivCu25519);
+    // users that don't have a usable Cu25519 key
+    auto rsaUserIdx = std::make_shared<std::vector<size_t>>();
+    std::vector<Promise<void>> pubKeyPms;
+    auto wptr = weakHandle();
+    for (size_t i = 0; i < users->size(); i++)
+    {
+        // Request all pubkeys upfront, so that the ones not in the attribute
+        // cache are fetched in parallel
+        pubKeyPms.push_back(mUserAttrCache.getAttr((*users)[i], ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
+        .then([this, wptr, batch, rsaUserIdx, users, encKeys, i](Buffer* pubKey)
+        {
+            wptr.throwIfDeleted();
+            if (!pubKey || pubKey->empty())
+            {
+                rsaUserIdx->push_back(i);
+                return;
+            }
+            auto symKey = mSymmKeyCache->get((*users)[i], *pubKey);
+            if (symKey)
+            {
+                (*encKeys)[i] = wrapSendKey(batch->sendKey, *symKey);
+                return;
+            }
+            batch->pubKeys.emplace_back(*pubKey);
+            batch->userIdx.push_back(i);
+        })
+        .fail([rsaUserIdx, i](const promise::Error& err)
+        {
+            rsaUserIdx->push_back(i);
+        }));
+    }
+
+    return promise::when(pubKeyPms)
+    .then([this, wptr, batch]()
+    {
+        wptr.throwIfDeleted();
+        Promise<void> computed;
+        auto count = batch->userIdx.size();
+        if (!count)
+        {
+            computed.resolve();
+            return computed;
+        }
+        batch->symKeys.resize(count);
+        batch->encKeys.resize(count);
+        auto jobCount = std::min<size_t>(count, mDecryptPool->threadCount());
+        auto remaining = std::make_shared<size_t>(jobCount);
+        for (size_t job = 0; job < jobCount; job++)
+        {
+            runInPool([batch, job, jobCount]()
+            {
+                for (size_t i = job; i < batch->userIdx.size(); i += jobCount)
+                {
+                    batch->compute(i);
+                }
+            },
+            [remaining, computed]() mutable
+            {
+                if (--(*remaining) == 0)
+                    computed.resolve();
+            });
+        }
+        return computed;
+    })
+    .then([this, wptr, batch, rsaUserIdx, users, encKeys, sendKey]()
+    {
+        wptr.throwIfDeleted();
+        for (size_t i = 0; i < batch->userIdx.size(); i++)
+        {
+            auto userIdx = batch->userIdx[i];
+            mSymmKeyCache->put((*users)[userIdx], batch->pubKeys[i], batch->symKeys[i]);
+            (*encKeys)[userIdx] = batch->encKeys[i];
+        }
+        std::vector<Promise<void>> rsaPms;
+        for (auto userIdx: *rsaUserIdx)
+        {
+            auto user = (*users)[userIdx];
+            STRONGVELOPE_LOG_DEBUG("Can't use EC encryption for user %s, falling back to RSA", user.toString().c_str());
+            rsaPms.push_back(rsaEncryptTo(std::static_pointer_cast<StaticBuffer>(sendKey), user)
+            .then([encKeys, userIdx](const std::shared_ptr<Buffer>& encryptedKey)
+            {
+                (*encKeys)[userIdx] = encryptedKey;
+            })
+            .fail([this, wptr, user](const promise::Error& err)
+            {
+                wptr.throwIfDeleted();
+                STRONGVELOPE_LOG_ERROR("No public encryption key (RSA or x25519) available for %s", user.toString().c_str());
+                return err;
+            }));
+        }
+        return promise::when(rsaPms);
+    });
+}
+
 promise::Promise<std::shared_ptr<Buffer>>
 ProtocolHandler::encryptChatTitle(const std::string& data, uint64_t extraUser)
 {
@@ -1115,7 +1588,7 @@ ProtocolHandler::encryptChatTitle(const std::string& data, uint64_t extraUser)
         tlv.addRecord(TLV_TYPE_INVITOR, mOwnHandle.val);
         tlv.addRecord(TLV_TYPE_NONCE, enc.nonce);
         tlv.addRecord(TLV_TYPE_KEYBLOB, StaticBuffer(keyCmd.buf()+17, keyCmd.dataSize()-17));
-        tlv.addRecord(TLV_TYPE_PAYLOAD, StaticBuffer(enc.ciphertext, false));
+        tlv.addRecord(TLV_TYPE_PAYLOAD, enc.ciphertext);
         Key<64> signature;
         signMessage(tlv, SVCRYPTO_PROTOCOL_VERSION, Message::kMsgChatTitle,
             enc.key, signature);
@@ -9,9 +9,15 @@
 #define STRONGVELOPE_H_
 #include <vector>
 #include <map>
+#include <list>
 #include <string>
 #include <assert.h>
 #include <iostream>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <buffer.h>
 #include <karereId.h>
 #include <chatdMsg.h>
@@ -49,6 +55,8 @@ class SqliteDb;
 
 namespace strongvelope
 {
+class AesCtr;
+
 /**
  * "Enumeration" of TLV types used for the chat message transport container.
  *
@@ -149,6 +157,14 @@ public:
         mBuf = mData;
         assign(other.buf(), other.dataSize());
     }
+    // The implicit copy operations would copy mBuf, pointing to the data of the
+    // source object
+    Key(const Key& other): Key(static_cast<const StaticBuffer&>(other)) {}
+    Key& operator=(const Key& other)
+    {
+        assign(other.buf(), other.dataSize());
+        return *this;
+    }
     Key(const char* data, size_t len)
     {
         assert(len == Size);
@@ -156,7 +172,32 @@ public:
         assign(data, len);
     }
 };
-typedef Key<16> SendKey;
+/** @brief A symmetric message key. Keeps an AES-CTR cipher context with the
+ * expanded key schedule, built on first use, so that the many messages that
+ * share a key don't redo the key expansion. The context is not shared with
+ * copies of the key, so a copy can be used by another thread.
+ */
+class SendKey: public Key<16>
+{
+protected:
+    mutable std::shared_ptr<AesCtr> mCtrCipher;
+public:
+    using Key<16>::Key;
+    SendKey(size_t len=16): Key<16>(len) {}
+    SendKey(const SendKey& other): Key<16>(other) {}
+    SendKey& operator=(const SendKey& other)
+    {
+        assign(other.buf(), other.dataSize());
+        return *this;
+    }
+    void assign(const char* src, size_t len)
+    {
+        Key<16>::assign(src, len);
+        mCtrCipher.reset();
+    }
+    /** @brief Returns the cipher context for this key, set up with the specified IV */
+    AesCtr& ctrCipher(const StaticBuffer& iv) const;
+};
 typedef Key<32> EcKey;
 
 class ProtocolHandler;
@@ -164,6 +205,7 @@ class ProtocolHandler;
 struct ParsedMessage: public chatd::Message::ManagementInfo, public karere::DeleteTrackable
 {
     ProtocolHandler& mProtoHandler;
+    karere::Id chatid; //copied from the protocol handler, for logging from worker threads
     uint8_t protocolVersion;
     karere::Id sender;
     Key<32> nonce;
@@ -178,10 +220,11 @@ struct ParsedMessage: public chatd::Message::ManagementInfo, public karere::Dele
     uint64_t prevKeyId;
     Buffer encryptedKey; //may contain also the prev key, concatenated
     ParsedMessage(const chatd::Message& src, ProtocolHandler& protoHandler);
-    bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey);
+    bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey) const;
     void parsePayload(const StaticBuffer& data, chatd::Message& msg);
     void parsePayloadWithUtfBackrefs(const StaticBuffer& data, chatd::Message& msg);
-    void symmetricDecrypt(const StaticBuffer& key, chatd::Message& outMsg);
+    void decryptPayload(AesCtr& cipher, chatd::Message& msg);
+    void symmetricDecrypt(const SendKey& key, chatd::Message& outMsg);
     promise::Promise<chatd::Message*> decryptChatTitle(chatd::Message* msg);
 };
 
@@ -209,7 +252,7 @@ enum
  *  nonce */
 struct EncryptedMessage
 {
-    std::string ciphertext; //crypto++ does not support binary buffers in AES CTR mode, which is used for encrypting messages
+    Buffer ciphertext;
     SendKey key;
     chatd::BackRefId backRefId;
     Key<SVCRYPTO_NONCE_SIZE> nonce;
@@ -233,6 +276,61 @@ struct UserKeyId
 
 class TlvWriter;
 
+/** @brief A pool of worker threads that run the CPU-bound part of message
+ * decryption - signature verification and payload decryption, and of the
+ * shared key computation when distributing a send key. The jobs must
+ * not touch any karere objects except the ones they own, and must marshal
+ * their results back to the karere thread. Can be shared by all chatrooms.
+ */
+class DecryptPool
+{
+public:
+    typedef std::function<void()> Job;
+    explicit DecryptPool(unsigned threadCount);
+    ~DecryptPool();
+    unsigned threadCount() const { return (unsigned)mThreads.size(); }
+    void post(Job&& job);
+protected:
+    std::vector<std::thread> mThreads;
+    std::mutex mMutex;
+    std::condition_variable mCondVar;
+    std::deque<Job> mJobs;
+    bool mTerminating = false;
+    void run();
+};
+
+/** @brief Client-wide cache of the pairwise symmetric keys shared with other
+ * users, which are derived from our and their Cu25519 keys. Can be shared by
+ * the protocol handlers of all chatrooms. Each key is stored together with the
+ * Cu25519 public key of the peer it was derived from, and is valid only for
+ * that public key.
+ * If a db is given, the keys are also persisted there, encrypted with a key
+ * derived from our private Cu25519 key, and loaded from it on demand.
+ */
+class SymmKeyCache
+{
+protected:
+    struct Entry
+    {
+        EcKey pubKey;
+        std::shared_ptr<SendKey> key;
+    };
+    std::map<karere::Id, Entry> mKeys;
+    SqliteDb* mDb;
+    SendKey mDbKey;
+    bool loadFromDb(karere::Id user, Entry& entry);
+public:
+    SymmKeyCache(SqliteDb* db, const StaticBuffer& privCu25519);
+    /** @brief Returns the key shared with \c user, if it is cached and was
+     * derived from \c pubKey. Otherwise the cached key (if any) is stale and
+     * is removed, and \c nullptr is returned */
+    std::shared_ptr<SendKey> get(karere::Id user, const StaticBuffer& pubKey);
+    void put(karere::Id user, const StaticBuffer& pubKey, const std::shared_ptr<SendKey>& key);
+    /** @brief Removes the key of the user - called when the Cu25519 public key
+     * of the user changes */
+    void remove(karere::Id user);
+};
+
 class ProtocolHandler: public chatd::ICrypto, public karere::DeleteTrackable
 {
 protected:
@@ -253,14 +351,27 @@ protected:
     {
         std::shared_ptr<SendKey> key;
         std::shared_ptr<promise::Promise<std::shared_ptr<SendKey>>> pms;
+        /** Position in mKeyLru, valid only if \c key is set */
+        std::list<UserKeyId>::iterator lruPos;
         KeyEntry(){}
-        KeyEntry(const std::shared_ptr<SendKey>& aKey): key(aKey){}
     };
+    /** Keys are loaded from the db on demand, and only the \c kMaxCachedKeys
+     * most recently used ones are kept in memory. Entries of keys that are
+     * still being obtained (have a promise) are never evicted */
     std::map<UserKeyId, KeyEntry> mKeys;
-    std::map<karere::Id, std::shared_ptr<SendKey>> mSymmKeyCache;
+    /** Entries of mKeys that have a key, most recently used first */
+    std::list<UserKeyId> mKeyLru;
+    enum { kMaxCachedKeys = 256 };
+    std::shared_ptr<SymmKeyCache> mSymmKeyCache;
     karere::SetOfIds* mParticipants = nullptr;
     bool mParticipantsChanged = true;
     bool mIsDestroying = false;
+    std::shared_ptr<DecryptPool> mDecryptPool;
+    // Completion callbacks of jobs posted to the pool, by job id
+    std::map<uint64_t, std::function<void()>> mPoolCallbacks;
+    uint64_t mNextPoolJobId = 0;
+    // How many messages per worker thread chatd may queue for decryption ahead
+    enum { kDecryptAheadPerThread = 8 };
 public:
     karere::Id chatid;
     karere::Id ownHandle() const { return mOwnHandle; }
@@ -269,7 +380,13 @@ public:
         const StaticBuffer& privRsa, karere::UserAttrCache& userAttrCache,
         SqliteDb& db, karere::Id aChatId, void *ctx);
 protected:
-    void loadKeysFromDb();
+    std::shared_ptr<SendKey> loadKeyFromDb(UserKeyId ukid);
+    /** @brief Returns the entry of the key, loading the key from the db if it
+     * is not in memory. If the key is not known, an empty entry is created */
+    KeyEntry& getKeyEntry(UserKeyId ukid);
+    /** @brief Sets the key of an entry, adding it to the LRU of cached keys */
+    void setEntryKey(UserKeyId ukid, KeyEntry& entry, const std::shared_ptr<SendKey>& key);
+    void evictKeys();
     promise::Promise<std::shared_ptr<SendKey>> getKey(UserKeyId ukid, bool legacy=false);
     void addDecryptedKey(UserKeyId ukid, const std::shared_ptr<SendKey>& key);
         /**
@@ -304,6 +421,12 @@ protected:
         encryptKeyTo(const std::shared_ptr<SendKey>& sendKey, karere::Id toUser);
     promise::Promise<std::pair<chatd::KeyCommand*, std::shared_ptr<SendKey>>>
     encryptKeyToAllParticipants(const std::shared_ptr<SendKey>& key, uint64_t extraUser=0);
+    /** @brief Encrypts the send key to all the specified users, computing the
+     * shared keys that are not cached yet in the decrypt pool. The encrypted
+     * keys are stored in \c encKeys at the position of the respective user */
+    promise::Promise<void> poolEncryptKeyTo(const std::shared_ptr<SendKey>& sendKey,
+        const std::shared_ptr<std::vector<karere::Id>>& users,
+        const std::shared_ptr<std::vector<std::shared_ptr<Buffer>>>& encKeys);
 
     void msgEncryptWithKey(chatd::Message &src, chatd::MsgCommand& dest,
         const StaticBuffer& key);
@@ -311,6 +434,14 @@ protected:
         const std::shared_ptr<ParsedMessage>& parsedMsg, chatd::Message* msg);
     chatd::Message* legacyMsgDecrypt(const std::shared_ptr<ParsedMessage>& parsedMsg,
         chatd::Message* msg, const SendKey& key);
+    /** @brief Runs \c work in the decrypt pool, and then \c done on the karere
+     * thread, unless we are deleted meanwhile */
+    void runInPool(std::function<void()>&& work, std::function<void()>&& done);
+    /** @brief Verifies and decrypts the message in the decrypt pool. The message
+     * object is updated on the karere thread, when the result is marshalled back */
+    promise::Promise<chatd::Message*> poolMsgDecrypt(
+        const std::shared_ptr<ParsedMessage>& parsedMsg, chatd::Message* msg,
+        const SendKey& sendKey, const EcKey& edKey);
 
     promise::Promise<std::shared_ptr<Buffer>>
         rsaEncryptTo(const std::shared_ptr<StaticBuffer>& data, karere::Id toUser);
@@ -341,6 +472,19 @@ public:
         virtual promise::Promise<std::shared_ptr<Buffer>> encryptChatTitle(const std::string& data, uint64_t extraUser=0);
         virtual promise::Promise<std::string> decryptChatTitle(const Buffer& data);
         virtual const chatd::KeyCommand* unconfirmedKeyCmd() const { return mUnconfirmedKeyCmd.get(); }
+        virtual unsigned decryptAheadWindow() const
+        {
+            return mDecryptPool ? mDecryptPool->threadCount() * kDecryptAheadPerThread : 0;
+        }
+
+        /** @brief Sets the thread pool that will do the signature verification
+         * and decryption of messages, once their keys are available. If \c pool
+         * is null, messages are decrypted on the karere thread */
+        void setDecryptPool(const std::shared_ptr<DecryptPool>& pool) { mDecryptPool = pool; }
+
+        /** @brief Makes the handler use a pairwise key cache shared with other
+         * handlers, instead of its own one */
+        void setSymmKeyCache(const std::shared_ptr<SymmKeyCache>& cache) { mSymmKeyCache = cache; }
 
         //====
         promise::Promise<std::shared_ptr<SendKey>>
@@ -5,6 +5,7 @@
 #include <codecvt>
 #include <locale>
 #include <mega/types.h>
+#include <base/gcmpp.h>
 
 using namespace promise;
 using namespace std;
@@ -125,23 +126,61 @@ void UserAttrCache::dbWriteNull(UserAttrPair key)
     UACACHE_LOG_DEBUG("dbWriteNull attr %s as NULL", key.toString().c_str());
 }
 
-UserAttrCache::UserAttrCache(Client& aClient): mClient(aClient)
+UserAttrCache::UserAttrCache(Client& aClient, bool lazy): mClient(aClient), mLazy(lazy)
 {
-    //load all attributes from db
-    SqliteStmt stmt(mClient.db, "select userid, type, data from userattrs");
-    while(stmt.step())
+    auto start = timestampMs();
+    if (mLazy)
+    {
+        // Only the names and emails of users are needed at startup, to
+        // display the contact and chat lists. Other attributes (avatars for
+        // example) are loaded from the db when requested
+        SqliteStmt stmt(mClient.db, "select userid, type, data from userattrs where type in (?,?,?)");
+        stmt << (int)::mega::MegaApi::USER_ATTR_FIRSTNAME
+             << (int)::mega::MegaApi::USER_ATTR_LASTNAME
+             << (int)USER_ATTR_EMAIL;
+        while(stmt.step())
+        {
+            addItemFromDb(stmt);
+        }
+    }
+    else
     {
-        std::unique_ptr<Buffer> data(new Buffer((size_t)sqlite3_column_bytes(stmt, 2)));
-        stmt.blobCol(2, *data);
-        UserAttrPair key(stmt.uint64Col(0), stmt.intCol(1));
-        emplace(std::make_pair(key, std::make_shared<UserAttrCacheItem>(
-                *this, data.release(), kCacheFetchNotPending)));
-//        UACACHE_LOG_DEBUG("loaded attr %s", key.toString().c_str());
+        //load all attributes from db
+        SqliteStmt stmt(mClient.db, "select userid, type, data from userattrs");
+        while(stmt.step())
+        {
+            addItemFromDb(stmt);
+        }
     }
-    UACACHE_LOG_DEBUG("loaded %zu entries from db", size());
+    UACACHE_LOG_DEBUG("loaded %zu entries from db in %lld ms%s", size(),
+        (long long)(timestampMs() - start), mLazy ? ", rest will be loaded on demand" : "");
     mClient.api.sdk.addGlobalListener(this);
 }
 
+UserAttrCache::iterator UserAttrCache::addItemFromDb(SqliteStmt& stmt)
+{
+    std::unique_ptr<Buffer> data(new Buffer((size_t)sqlite3_column_bytes(stmt, 2)));
+    stmt.blobCol(2, *data);
+    UserAttrPair key(stmt.uint64Col(0), stmt.intCol(1));
+    return emplace(std::make_pair(key, std::make_shared<UserAttrCacheItem>(
+        *this, data.release(), kCacheFetchNotPending))).first;
+}
+
+UserAttrCache::iterator UserAttrCache::loadFromDb(UserAttrPair key)
+{
+    if (key.attrType & USER_ATTR_FLAG_COMPOSITE) //not backed by the db
+        return end();
+
+    SqliteStmt stmt(mClient.db, "select userid, type, data from userattrs where userid=? and type=?");
+    stmt << key.user << (int)key.attrType;
+    if (!stmt.step())
+        return end();
+
+    UACACHE_LOG_DEBUG("Attribute %s loaded from db", key.toString().c_str());
+    mStats.dbLoads++;
+    return addItemFromDb(stmt);
+}
+
 const char* attrName(uint8_t type)
 {
     switch (type)
@@ -177,6 +216,11 @@ void UserAttrCache::onUserAttrChange(uint64_t userid, int changed)
         auto it = find(key);
         if (it == end()) //we don't have such attribute
         {
+            if (mLazy && (type & USER_ATTR_FLAG_COMPOSITE) == 0)
+            {
+                // it may be in the db, without being loaded
+                dbInvalidateItem(key);
+            }
             UACACHE_LOG_DEBUG("Attr %s change received for unknown user, ignoring", attrName(type));
             continue;
         }
@@ -202,7 +246,7 @@ void UserAttrCache::onUserAttrChange(uint64_t userid, int changed)
         UACACHE_LOG_DEBUG("Attr %s change received, invalidated and re-fetching",
             key.toString().c_str());
         item->pending = kCacheFetchUpdatePending;
-        fetchAttr(key, item);
+        queueFetch(key);
     }
 }
 void UserAttrCache::dbInvalidateItem(UserAttrPair key)
@@ -233,6 +277,7 @@ void UserAttrCacheItem::notify()
 void UserAttrCacheItem::resolve(UserAttrPair key)
 {
     pending = kCacheFetchNotPending;
+    parent.mStats.resolved++;
     UACACHE_LOG_DEBUG("Attr %s fetched, writing to db and doing callbacks...", key.toString().c_str());
     parent.dbWrite(key, *data);
     notify();
@@ -246,6 +291,7 @@ void UserAttrCacheItem::resolveNoDb(UserAttrPair key)
 void UserAttrCacheItem::error(UserAttrPair key, int errCode)
 {
     pending = kCacheFetchNotPending;
+    parent.mStats.resolved++;
     data.reset();
     if (errCode == ::mega::API_ENOENT)
     {
@@ -285,7 +331,12 @@ UserAttrCache::Handle UserAttrCache::getAttr(uint64_t userHandle, unsigned type,
             void* userp, UserAttrReqCbFunc cb, bool oneShot)
 {
     UserAttrPair key(userHandle, type);
+    mStats.requests++;
     auto it = find(key);
+    if (it == end() && mLazy)
+    {
+        it = loadFromDb(key);
+    }
     if (it != end())
     {
         auto& item = *it->second;
@@ -316,10 +367,64 @@ UserAttrCache::Handle UserAttrCache::getAttr(uint64_t userHandle, unsigned type,
     auto item = std::make_shared<UserAttrCacheItem>(*this, nullptr, kCacheFetchNewPending);
     it = emplace(key, item).first;
     Handle handle = cb ? item->addCb(cb, userp, oneShot) : Handle::invalid();
-    fetchAttr(key, item);
+    if (key.attrType & USER_ATTR_FLAG_COMPOSITE)
+    {
+        // only requests the component attributes, which are queued
+        fetchAttr(key, item);
+    }
+    else
+    {
+        queueFetch(key);
+    }
     return handle;
 }
 
+void UserAttrCache::queueFetch(UserAttrPair key)
+{
+    // Attributes that are already queued or being fetched are not queued
+    // again, as their cache items are pending, and new requests just add
+    // callbacks to them
+    mFetchQueue.insert(key);
+    if (mFetchFlushScheduled)
+        return;
+    mFetchFlushScheduled = true;
+    auto wptr = weakHandle();
+    marshallCall([wptr, this]()
+    {
+        if (wptr.deleted())
+            return;
+        flushFetchQueue();
+    }, mClient.appCtx);
+}
+
+void UserAttrCache::flushFetchQueue()
+{
+    mFetchFlushScheduled = false;
+    if (!mIsLoggedIn) //onLogin() will fetch all pending items
+    {
+        mFetchQueue.clear();
+        return;
+    }
+    auto queue = std::move(mFetchQueue);
+    mFetchQueue.clear();
+    size_t count = 0;
+    for (auto& key: queue)
+    {
+        auto it = find(key);
+        if (it == end() || it->second->pending == kCacheFetchNotPending)
+            continue; //deleted or resolved meanwhile
+        fetchAttr(key, it->second);
+        count++;
+    }
+    if (!count)
+        return;
+    mStats.fetches += count;
+    mStats.batches++;
+    UACACHE_LOG_DEBUG("Issued %zu attribute fetches in one batch (total: %s requests, %s fetches in %s batches, %s attributes resolved)",
+        count, std::to_string(mStats.requests).c_str(), std::to_string(mStats.fetches).c_str(),
+        std::to_string(mStats.batches).c_str(), std::to_string(mStats.resolved).c_str());
+}
+
 void UserAttrCache::fetchAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
 {
     if (!mIsLoggedIn && !(key.attrType & USER_ATTR_FLAG_COMPOSITE))
@@ -487,7 +592,7 @@ void UserAttrCache::onLogin()
     for (auto& item: *this)
     {
         if (item.second->pending != kCacheFetchNotPending)
-            fetchAttr(item.first, item.second);
+            queueFetch(item.first);
     }
 }
 
@@ -4,12 +4,14 @@
 #include "karereId.h"
 #include <megaapi.h>
 #include <list>
+#include <set>
 #include <promise.h>
 #include <base/trackDelete.h>
 
 #define UACACHE_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_uacache, fmtString, ##__VA_ARGS__)
 
 class Buffer;
+class SqliteStmt;
 
 namespace mega
 {
@@ -126,9 +128,27 @@ class UserAttrCache: public std::map<UserAttrPair, std::shared_ptr<UserAttrCache
 protected:
     Client& mClient;
     bool mIsLoggedIn = false;
+    /** If set, only the attributes needed at startup are loaded from the db
+     * upfront, and the rest are loaded by \c getAttr() when requested */
+    bool mLazy;
+    /** Creates a cache item from the current row of \c stmt, with columns
+     * userid, type and data */
+    iterator addItemFromDb(SqliteStmt& stmt);
+    /** Looks up the attribute in the db, and if it's there, creates a cache
+     * item for it. Returns \c end() if the attribute is not in the db */
+    iterator loadFromDb(UserAttrPair key);
     void dbWrite(UserAttrPair key, const Buffer& data);
     void dbWriteNull(UserAttrPair key);
     void dbInvalidateItem(UserAttrPair item);
+    /** Attributes that have to be fetched from the API. They are collected
+     * during one event loop iteration, and then fetched all at once, so that
+     * the SDK can send the requests in one batch */
+    std::set<UserAttrPair> mFetchQueue;
+    bool mFetchFlushScheduled = false;
+    /** @brief Queues the attribute for fetching at the end of the current
+     * event loop iteration */
+    void queueFetch(UserAttrPair key);
+    void flushFetchQueue();
     void fetchAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
 //actual attrib fetch backend functions
     void fetchUserFullName(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
@@ -157,7 +177,22 @@ public:
      * if it has not been assigned a valid value, as returned by \c getAttr()
      */
     typedef UserAttrReqCb::WeakRefHandle Handle;
-    UserAttrCache(Client& aClient);
+    /** @brief Counters of attribute requests and of the API fetches done to
+     * serve them */
+    struct Stats
+    {
+        /** Number of \c getAttr() calls */
+        uint64_t requests = 0;
+        /** Number of attributes that were loaded from the db on demand */
+        uint64_t dbLoads = 0;
+        /** Number of attribute fetches issued to the API */
+        uint64_t fetches = 0;
+        /** Number of batches in which the fetches were issued */
+        uint64_t batches = 0;
+        /** Number of attributes resolved by fetches, successfully or not */
+        uint64_t resolved = 0;
+    };
+    UserAttrCache(Client& aClient, bool lazy=true);
     ~UserAttrCache();
     /** @brief gets the attribute \c attrType of user \c user. When the attribute
      * is successfully obtained, the callback \c will be called with a Buffer object, containing
@@ -182,6 +217,9 @@ public:
      * request is currently registered (expired one-shot for example).
      */
     bool removeCb(Handle handle);
+    const Stats& stats() const { return mStats; }
+protected:
+    Stats mStats;
 };
 
 }
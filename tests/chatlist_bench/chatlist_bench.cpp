@@ -0,0 +1,144 @@
+/**
+ * Contention benchmark of the chat list getters of MegaChatApiImpl. Reader
+ * threads keep calling getUnreadChats() and getChatListItem() while the loop
+ * thread ingests synthetic traffic: for every event it holds sdkMutex for a
+ * while, as the karere thread does when it processes a chatd message, and
+ * updates the item of one chat.
+ *
+ * It compares the readers taking sdkMutex and reading the live items, which is
+ * what the getters used to do, with the readers using the snapshots that the
+ * loop publishes with karere::SnapshotMap, as publishChatListItem() does.
+ *
+ * Usage: chatlist_bench [readers] [rooms] [seconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "snapshotMap.h"
+
+typedef uint64_t Handle;
+
+/** Stands for MegaChatListItemPrivate, which is copied to every snapshot */
+struct Item
+{
+    Handle chatid;
+    std::string title;
+    std::string lastMessage;
+    int unreadCount;
+    bool active;
+    Item(Handle aChatid): chatid(aChatid), title("Chat room title " + std::to_string(aChatid)),
+        lastMessage("Last message of the chat room"), unreadCount(0), active(true) {}
+};
+
+typedef std::chrono::steady_clock Clock;
+
+struct Stats
+{
+    std::atomic<uint64_t> reads;
+    std::atomic<uint64_t> events;
+    std::atomic<int64_t> maxReadUs;
+    Stats(): reads(0), events(0), maxReadUs(0) {}
+};
+
+static void run(bool snapshots, unsigned readers, unsigned rooms, double seconds)
+{
+    std::recursive_mutex sdkMutex;
+    std::map<Handle, Item> live;
+    karere::SnapshotMap<Handle, Item> chatList;
+    for (Handle chatid = 1; chatid <= rooms; chatid++)
+    {
+        auto it = live.emplace(chatid, Item(chatid)).first;
+        chatList.publish(chatid, std::make_shared<Item>(it->second));
+    }
+
+    Stats stats;
+    std::atomic<bool> stop(false);
+    std::thread loop([&]()
+    {
+        for (uint64_t event = 0; !stop.load(); event++)
+        {
+            std::lock_guard<std::recursive_mutex> lock(sdkMutex);
+            //decryption, db writes etc. of an incoming message
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+            Item& item = live.at(1 + event % rooms);
+            item.unreadCount++;
+            item.lastMessage = "Message " + std::to_string(event);
+            if (snapshots)
+            {
+                chatList.publish(item.chatid, std::make_shared<Item>(item));
+            }
+            stats.events++;
+        }
+    });
+
+    std::vector<std::thread> threads;
+    for (unsigned r = 0; r < readers; r++)
+    {
+        threads.emplace_back([&, r]()
+        {
+            for (uint64_t i = r; !stop.load(); i++)
+            {
+                auto start = Clock::now();
+                int unread = 0;
+                Item* copy = nullptr;
+                Handle chatid = 1 + i % rooms;
+                if (snapshots)
+                {
+                    auto snapshot = chatList.get();
+                    for (auto& item: snapshot->items)
+                    {
+                        if (item.second->active && item.second->unreadCount)
+                            unread++;
+                    }
+                    auto it = snapshot->items.find(chatid);
+                    copy = new Item(*it->second);
+                }
+                else
+                {
+                    std::lock_guard<std::recursive_mutex> lock(sdkMutex);
+                    for (auto& item: live)
+                    {
+                        if (item.second.active && item.second.unreadCount)
+                            unread++;
+                    }
+                    copy = new Item(live.at(chatid));
+                }
+                delete copy;
+                (void)unread;
+                int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+                int64_t max = stats.maxReadUs.load();
+                while ((us > max) && !stats.maxReadUs.compare_exchange_weak(max, us));
+                stats.reads++;
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    loop.join();
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+    printf("%-9s  %9.0f reads/s  %7.0f events/s  max read latency %lld us\n",
+           snapshots ? "snapshot" : "sdkMutex", stats.reads / seconds,
+           stats.events / seconds, (long long)stats.maxReadUs.load());
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned readers = (argc > 1) ? atoi(argv[1]) : 3;
+    unsigned rooms = (argc > 2) ? atoi(argv[2]) : 500;
+    double seconds = (argc > 3) ? atof(argv[3]) : 2;
+    printf("%u readers, %u rooms, %u cores\n", readers, rooms, std::thread::hardware_concurrency());
+    run(false, readers, rooms, seconds);
+    run(true, readers, rooms, seconds);
+    return 0;
+}
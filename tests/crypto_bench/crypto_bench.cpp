@@ -0,0 +1,91 @@
+/**
+ * Microbenchmark of the AES-CTR message payload encryption. Compares the
+ * in-place AesCtr class from cryptofunctions.h with the std::string based
+ * Crypto++ filter pipeline that it replaced.
+ *
+ * Usage: crypto_bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include "../../src/strongvelope/strongvelope.h"
+#include "../../src/strongvelope/cryptofunctions.h"
+#include <cryptopp/filters.h>
+
+using namespace strongvelope;
+
+//the std::string based implementation that AesCtr replaced
+static std::string stringAesCtr(const std::string& text,
+    const StaticBuffer& derivedkey, const StaticBuffer& iv)
+{
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption encryptor;
+    std::string result;
+    encryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
+    CryptoPP::StringSource s(text, true,
+        new CryptoPP::StreamTransformationFilter(encryptor,
+            new CryptoPP::StringSink(result)
+        ) // StreamTransformationFilter
+    ); // StringSource
+    return result;
+}
+
+template <class F>
+static void measure(const char* name, size_t msgSize, unsigned count, F&& func)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < count; i++)
+    {
+        func(i);
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-24s %6zu bytes: %10.0f msgs/s, %8.1f MB/s\n", name, msgSize,
+        count / secs, (double)count * msgSize / secs / (1024 * 1024));
+}
+
+int main(int argc, char** argv)
+{
+    unsigned count = (argc > 1) ? atoi(argv[1]) : 200000;
+    if (sodium_init() == -1)
+    {
+        fprintf(stderr, "Error initializing libsodium\n");
+        return 1;
+    }
+    Key<SVCRYPTO_KEY_SIZE> key;
+    randombytes_buf(key.ubuf(), key.dataSize());
+    Key<CryptoPP::AES::BLOCKSIZE> iv;
+    randombytes_buf(iv.ubuf(), iv.dataSize());
+
+    size_t checksum = 0; //prevents the compiler from optimizing out the work
+    for (size_t msgSize: {32, 256, 1024, 16384})
+    {
+        std::string text(msgSize, 'x');
+        measure("string pipeline", msgSize, count, [&](unsigned i)
+        {
+            iv.buf()[0] = (char)i;
+            std::string cipher = stringAesCtr(text, key, iv);
+            checksum += (unsigned char)cipher[0];
+        });
+
+        Buffer buf(msgSize);
+        buf.append(text.c_str(), text.size());
+        measure("AesCtr, new per msg", msgSize, count, [&](unsigned i)
+        {
+            iv.buf()[0] = (char)i;
+            AesCtr(key, iv).process(buf);
+            checksum += (unsigned char)buf.buf()[0];
+        });
+
+        //same as SendKey::ctrCipher(), which keeps the expanded key
+        AesCtr cipher(key, iv);
+        measure("AesCtr, setIV", msgSize, count, [&](unsigned i)
+        {
+            iv.buf()[0] = (char)i;
+            cipher.setIV(iv);
+            cipher.process(buf);
+            checksum += (unsigned char)buf.buf()[0];
+        });
+    }
+    printf("(checksum %zu)\n", checksum);
+    return 0;
+}
@@ -0,0 +1,116 @@
+/**
+ * Benchmark of karere::EventQueue, the queue of the messages posted to the
+ * karere thread, with 1, 4 and 16 producer threads and one consumer. The
+ * consumer is woken up through an eventfd, which stands for the waiter of
+ * MegaChatApiImpl, and it drains the queue on every wakeup, as
+ * sendPendingEvents() does. It is compared with the previous design: a
+ * mutex-protected deque, with a notification for every post.
+ *
+ * Usage: eventqueue_bench [posts]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "eventQueue.h"
+
+/** The previous queue of MegaChatApiImpl */
+class MutexQueue
+{
+protected:
+    std::deque<void*> mEvents;
+    std::mutex mMutex;
+public:
+    void push(void* event)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mEvents.push_back(event);
+    }
+    void* pop()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mEvents.empty())
+            return nullptr;
+        void* event = mEvents.front();
+        mEvents.pop_front();
+        return event;
+    }
+};
+
+static void notify(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0)
+        perror("write");
+}
+
+/** Posts \c count messages from \c producers threads, and returns the posts
+ * per second until the consumer has popped all of them */
+template <class Q, class Post>
+static double run(unsigned producers, unsigned count, Post&& post)
+{
+    Q queue;
+    int fd = eventfd(0, EFD_NONBLOCK);
+    std::vector<megaMessage> msgs(count, megaMessage(nullptr));
+    unsigned popped = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer([&queue, fd, count, &popped]()
+    {
+        while (popped < count)
+        {
+            uint64_t val;
+            if (read(fd, &val, sizeof(val)) < 0)
+                std::this_thread::yield();
+            while (queue.pop())
+                popped++;
+        }
+    });
+    std::vector<std::thread> threads;
+    for (unsigned p = 0; p < producers; p++)
+    {
+        threads.emplace_back([&queue, &msgs, &post, fd, p, producers, count]()
+        {
+            for (unsigned i = p; i < count; i += producers)
+            {
+                post(queue, &msgs[i], fd);
+            }
+        });
+    }
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+    consumer.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    close(fd);
+    return count / secs;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned count = (argc > 1) ? atoi(argv[1]) : 400000;
+    printf("%u posts, %u cores\n", count, std::thread::hardware_concurrency());
+    printf("producers   mutex, notify every post   lock-free, coalesced notify\n");
+    for (unsigned producers: { 1, 4, 16 })
+    {
+        double mutexRate = run<MutexQueue>(producers, count, [](MutexQueue& queue, megaMessage* msg, int fd)
+        {
+            queue.push(msg);
+            notify(fd);
+        });
+        double lockFreeRate = run<karere::EventQueue>(producers, count, [](karere::EventQueue& queue, megaMessage* msg, int fd)
+        {
+            if (queue.push(msg))
+                notify(fd);
+        });
+        printf("%9u   %20.1fM posts/s   %23.1fM posts/s\n", producers, mutexRate / 1e6, lockFreeRate / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * Microbenchmark of karere::IdHashMap, the open-addressing map used for the
+ * msgid and backref indexes of a chat, against the std::map it replaced and
+ * std::unordered_map. Before measuring, it cross-checks a random sequence of
+ * inserts, erases and lookups against std::map.
+ *
+ * Usage: idmap_bench [count]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include "../../src/karereId.h"
+
+using namespace karere;
+typedef uint32_t Idx;
+
+static bool crossCheck(unsigned ops)
+{
+    std::mt19937_64 rng(1);
+    IdHashMap<Idx> hmap;
+    std::map<Id, Idx> ref;
+    std::vector<Id> keys;
+    for (unsigned i = 0; i < ops; i++)
+    {
+        unsigned op = rng() % 4;
+        //reuse existing keys half of the time, so that erases and lookups hit
+        Id key = (keys.empty() || (rng() & 1)) ? Id(rng()) : keys[rng() % keys.size()];
+        if (op < 2)
+        {
+            Idx val = (Idx)rng();
+            bool inserted = hmap.emplace(key, val).second;
+            if (inserted != ref.emplace(key, val).second)
+                return false;
+            if (inserted)
+                keys.push_back(key);
+        }
+        else if (op == 2)
+        {
+            if (hmap.erase(key) != ref.erase(key))
+                return false;
+        }
+        auto it = hmap.find(key);
+        auto refit = ref.find(key);
+        if ((it == hmap.end()) != (refit == ref.end()))
+            return false;
+        if ((it != hmap.end()) && (it->second != refit->second))
+            return false;
+        if (hmap.size() != ref.size())
+            return false;
+    }
+    return true;
+}
+
+template <class M>
+static void measure(const char* name, const std::vector<Id>& ids, const std::vector<Id>& lookups)
+{
+    M map;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        map.emplace(ids[i], (Idx)i);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    size_t checksum = 0; //prevents the compiler from optimizing out the lookups
+    for (auto& id: lookups)
+    {
+        auto it = map.find(id);
+        if (it != map.end())
+            checksum += it->second;
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    for (auto& id: ids)
+    {
+        map.erase(id);
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    auto ns = [](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b, size_t n)
+    {
+        return std::chrono::duration<double, std::nano>(b - a).count() / n;
+    };
+    printf("%-16s insert %7.1f ns, lookup %7.1f ns, erase %7.1f ns (checksum %zu)\n", name,
+        ns(t0, t1, ids.size()), ns(t1, t2, lookups.size()), ns(t2, t3, ids.size()), checksum);
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = (argc > 1) ? atoi(argv[1]) : 100000;
+    if (!crossCheck(200000))
+    {
+        fprintf(stderr, "IdHashMap results differ from std::map\n");
+        return 1;
+    }
+    printf("Cross-check against std::map passed\n");
+
+    std::mt19937_64 rng(2);
+    std::vector<Id> ids;
+    for (size_t i = 0; i < count; i++)
+    {
+        Id id(rng());
+        if (id)
+            ids.push_back(id);
+    }
+    //look up present keys in random order, plus 10% of misses
+    std::vector<Id> lookups(ids);
+    std::shuffle(lookups.begin(), lookups.end(), rng);
+    for (size_t i = 0; i < count / 10; i++)
+    {
+        lookups.push_back(Id(rng()));
+    }
+
+    printf("%zu random ids, %zu lookups\n", ids.size(), lookups.size());
+    measure<std::map<Id, Idx>>("std::map", ids, lookups);
+    measure<std::unordered_map<Id, Idx>>("unordered_map", ids, lookups);
+    measure<IdHashMap<Idx>>("IdHashMap", ids, lookups);
+    return 0;
+}
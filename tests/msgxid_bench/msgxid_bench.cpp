@@ -0,0 +1,98 @@
+/**
+ * Microbenchmark of finding the chat that a NEWMSG confirmation (MSGID or
+ * MSGXID) refers to, with many rooms. Compares the scan over all chats, that
+ * chatd::Client::msgConfirm() used to do, with the client-wide msgxid index
+ * (Client::mChatForMsgxid). The rooms are modelled with the same containers
+ * as chatd: a map of chats by chatid, each with a send queue, and a pending
+ * message in every 10th room.
+ *
+ * Usage: msgxid_bench [confirmations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <chrono>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <random>
+#include "../../src/karereId.h"
+
+using namespace karere;
+
+struct Room
+{
+    struct SendingItem
+    {
+        uint8_t opcode;
+        Id msgxid;
+    };
+    std::list<SendingItem> mSending;
+    //same test as Chat::msgRemoveFromSending(): the confirmation is for the front item
+    bool msgConfirm(Id msgxid) const
+    {
+        return !mSending.empty() && (mSending.front().msgxid == msgxid);
+    }
+};
+
+int main(int argc, char** argv)
+{
+    unsigned count = (argc > 1) ? atoi(argv[1]) : 20000;
+    std::mt19937_64 rng(1);
+    for (size_t roomCount: {100, 1000, 5000, 20000})
+    {
+        std::map<Id, std::shared_ptr<Room>> chatForChatId;
+        std::unordered_map<Id, Room*> chatForMsgxid;
+        std::vector<Id> pending;
+        for (size_t i = 0; i < roomCount; i++)
+        {
+            auto room = std::make_shared<Room>();
+            if (i % 10 == 0)
+            {
+                Id msgxid(rng());
+                room->mSending.push_back(Room::SendingItem{1, msgxid});
+                chatForMsgxid[msgxid] = room.get();
+                pending.push_back(msgxid);
+            }
+            chatForChatId[Id(rng())] = room;
+        }
+        std::vector<Id> confirms(count);
+        for (auto& id: confirms)
+        {
+            id = pending[rng() % pending.size()];
+        }
+
+        size_t found = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (auto& msgxid: confirms)
+        {
+            for (auto& chat: chatForChatId)
+            {
+                if (chat.second->msgConfirm(msgxid))
+                {
+                    found++;
+                    break;
+                }
+            }
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        for (auto& msgxid: confirms)
+        {
+            auto it = chatForMsgxid.find(msgxid);
+            if ((it != chatForMsgxid.end()) && it->second->msgConfirm(msgxid))
+                found++;
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        if (found != 2 * confirms.size())
+        {
+            fprintf(stderr, "Not all confirmations were matched\n");
+            return 1;
+        }
+        printf("%6zu rooms: scan %10.1f ns, index %6.1f ns per confirmation\n", roomCount,
+            std::chrono::duration<double, std::nano>(t1 - t0).count() / count,
+            std::chrono::duration<double, std::nano>(t2 - t1).count() / count);
+    }
+    return 0;
+}
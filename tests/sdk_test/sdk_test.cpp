@@ -35,6 +35,8 @@ int main(int argc, char **argv)
     EXECUTE_TEST(t.TEST_ClearHistory(0, 1), "TEST Clear history");
     EXECUTE_TEST(t.TEST_EditAndDeleteMessages(0, 1), "TEST Edit & delete messages");
     EXECUTE_TEST(t.TEST_GroupChatManagement(0, 1), "TEST Groupchat management");
+    EXECUTE_TEST(t.TEST_RejectedMessageToManualSending(0, 1), "TEST Rejected message to manual sending");
+    EXECUTE_TEST(t.TEST_UnreadCountSeenBeforeDecrypt(0, 1), "TEST Unread count with seen before decrypt");
     EXECUTE_TEST(t.TEST_ResumeSession(0), "TEST Resume session");
     EXECUTE_TEST(t.TEST_Attachment(0, 1), "TEST Attachments");
     EXECUTE_TEST(t.TEST_SendContact(0, 1), "TEST Send contact");
@@ -1235,6 +1237,207 @@ void MegaChatApiTest::TEST_GroupChatManagement(unsigned int a1, unsigned int a2)
     sessionSecondary = NULL;
 }
 
+/**
+ * @brief TEST_RejectedMessageToManualSending
+ *
+ * Requirements:
+ * - Both accounts should be conctacts
+ * (if not accomplished, the test automatically solves the above)
+ *
+ * This test does the following:
+ * - Change privileges of the auxiliar account to read only in a group chat
+ * + Send message from the auxiliar account (rejected)
+ * - Check the message is moved to the manual-send queue, and is no longer
+ * found in the send queue by its temporal id
+ * - Remove the message from the manual-send queue
+ *
+ * The rejected message is handed to the app via onManualSendRequired(),
+ * whose handler takes ownership of it and deletes it. This checks that chatd
+ * does not access the message afterwards (run it with AddressSanitizer).
+ */
+void MegaChatApiTest::TEST_RejectedMessageToManualSending(unsigned int a1, unsigned int a2)
+{
+    char *sessionPrimary = login(a1);
+    char *sessionSecondary = login(a2);
+
+    // Prepare peers, privileges...
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
+    {
+        makeContact(a1, a2);
+        delete user;
+        user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    }
+
+    MegaChatHandle uh = user->getHandle();
+    delete user;
+    user = NULL;
+
+    MegaChatPeerList *peers = MegaChatPeerList::createInstance();
+    peers->addPeer(uh, MegaChatPeerList::PRIV_STANDARD);
+
+    MegaChatHandle chatid = getGroupChatRoom(a1, a2, peers);
+    delete peers;
+    peers = NULL;
+
+    // --> Open chatroom
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
+
+    bool *flagChatdOnline = &mChatConnectionOnline[a2]; *flagChatdOnline = false;
+    while (megaChatApi[a2]->getChatConnectionState(chatid) != MegaChatApi::CHAT_CONNECTION_ONLINE)
+    {
+        postLog("Waiting for connection to chatd...");
+        ASSERT_CHAT_TEST(waitForResponse(flagChatdOnline), "Timeout expired for connecting to chatd");
+        *flagChatdOnline = false;
+    }
+
+    // --> Change peer privileges to Read-only
+    MegaChatRoom *chatroom = megaChatApi[a1]->getChatRoom(chatid);
+    ASSERT_CHAT_TEST(chatroom, "Cannot get chatroom for id" + std::to_string(chatid));
+    bool isReadOnly = (chatroom->getPeerPrivilegeByHandle(uh) == MegaChatRoom::PRIV_RO);
+    delete chatroom;    chatroom = NULL;
+    if (!isReadOnly)
+    {
+        bool *flagUpdatePeerPermision = &requestFlagsChat[a1][MegaChatRequest::TYPE_UPDATE_PEER_PERMISSIONS]; *flagUpdatePeerPermision = false;
+        bool *peerUpdated1 = &peersUpdated[a2]; *peerUpdated1 = false;
+        megaChatApi[a1]->updateChatPermissions(chatid, uh, MegaChatRoom::PRIV_RO);
+        ASSERT_CHAT_TEST(waitForResponse(flagUpdatePeerPermision), "Timeout expired for update privilege of peer");
+        ASSERT_CHAT_TEST(!lastErrorChat[a1], "Failed to update privilege of peer Error: " + lastErrorMsgChat[a1] + " (" + std::to_string(lastErrorChat[a1]) + ")");
+        ASSERT_CHAT_TEST(waitForResponse(peerUpdated1), "Timeout expired for receiving peer update");
+    }
+
+    // --> Send a message without the right privilege
+    string msg0 = "HOLA " + mAccounts[a1].getEmail()+ " - This message goes to manual sending because I'm read-only";
+    bool *flagRejected = &chatroomListener->msgRejected[a2]; *flagRejected = false;
+    chatroomListener->mRejectedMessageRowId[a2] = MEGACHAT_INVALID_HANDLE;
+    chatroomListener->clearMessages(a2);
+    MegaChatMessage *msgSent = megaChatApi[a2]->sendMessage(chatid, msg0.c_str());
+    ASSERT_CHAT_TEST(msgSent, "Failed to send message");
+    MegaChatHandle tempId = msgSent->getTempId();
+    delete msgSent; msgSent = NULL;
+    ASSERT_CHAT_TEST(waitForResponse(flagRejected), "Timeout expired for rejection of message");
+    ASSERT_CHAT_TEST(chatroomListener->mConfirmedMessageHandle[a2] == MEGACHAT_INVALID_HANDLE, "Message confirmed, when it should fail");
+    MegaChatHandle rowId = chatroomListener->mRejectedMessageRowId[a2];
+    ASSERT_CHAT_TEST(rowId != MEGACHAT_INVALID_HANDLE, "Wrong row id of the message in the manual-send queue");
+
+    // the message must not be found in the send queue anymore
+    MegaChatMessage *msgPending = megaChatApi[a2]->getMessage(chatid, tempId);
+    ASSERT_CHAT_TEST(!msgPending, "Rejected message is still in the send queue");
+
+    // --> Discard the message
+    megaChatApi[a2]->removeUnsentMessage(chatid, rowId);
+
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
+
+    delete [] sessionPrimary;
+    sessionPrimary = NULL;
+    delete [] sessionSecondary;
+    sessionSecondary = NULL;
+}
+
+/**
+ * @brief TEST_UnreadCountSeenBeforeDecrypt
+ *
+ * Requirements:
+ * - Both accounts should be conctacts
+ * - The 1on1 chatroom between them should exist
+ * (if not accomplished, the test automatically solves the above)
+ *
+ * This test does the following:
+ *
+ * - Logout primary account keeping the session and the cache
+ * - Send some messages from secondary account
+ * - Login with primary account in a new session and mark the messages as seen
+ * - Resume the session of primary account
+ * + Check the unread count is zero
+ *
+ * When the session is resumed, the seen pointer may arrive while the messages
+ * are still being decrypted, which used to undercount the unread messages.
+ * The order depends on the server and on the decryption, so it is not forced.
+ */
+void MegaChatApiTest::TEST_UnreadCountSeenBeforeDecrypt(unsigned int a1, unsigned int a2)
+{
+    char *sessionPrimary = login(a1);
+    char *sessionSecondary = login(a2);
+
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
+    {
+        makeContact(a1, a2);
+    }
+    delete user;
+    user = NULL;
+
+    MegaChatHandle chatid = getPeerToPeerChatRoom(a1, a2);
+
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
+    loadHistory(a1, chatid, chatroomListener);
+    loadHistory(a2, chatid, chatroomListener);
+
+    // --> Logout primary account, keeping the session and the cache
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    logout(a1, false);
+
+    // --> Send some messages while primary account is offline
+    MegaChatHandle lastMsgId = MEGACHAT_INVALID_HANDLE;
+    for (int i = 0; i < 10; i++)
+    {
+        string msg = "Message " + std::to_string(i) + " to " + mAccounts[a1].getEmail() + " - It will be seen before being decrypted";
+        bool *flagConfirmed = &chatroomListener->msgConfirmed[a2]; *flagConfirmed = false;
+        chatroomListener->mConfirmedMessageHandle[a2] = MEGACHAT_INVALID_HANDLE;
+        MegaChatMessage *msgSent = megaChatApi[a2]->sendMessage(chatid, msg.c_str());
+        ASSERT_CHAT_TEST(msgSent, "Failed to send message");
+        delete msgSent; msgSent = NULL;
+        ASSERT_CHAT_TEST(waitForResponse(flagConfirmed), "Timeout expired for receiving confirmation by server");
+        lastMsgId = chatroomListener->mConfirmedMessageHandle[a2];
+    }
+    ASSERT_CHAT_TEST(lastMsgId != MEGACHAT_INVALID_HANDLE, "Wrong message id for sent message");
+
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    logout(a2, true);
+    delete [] sessionSecondary;
+    sessionSecondary = NULL;
+
+    // --> Login with primary account in a new session and mark the messages as seen
+    char *sessionOther = login(a2, NULL, mAccounts[a1].getEmail().c_str(), mAccounts[a1].getPassword().c_str());
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom in the new session of account " + std::to_string(a1+1));
+    loadHistory(a2, chatid, chatroomListener);
+    ASSERT_CHAT_TEST(megaChatApi[a2]->setMessageSeen(chatid, lastMsgId), "Failed to set the last message as seen");
+    sleep(3);   // give time to the seen pointer to reach the server
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    logout(a2, true);
+    delete [] sessionOther;
+    sessionOther = NULL;
+
+    // --> Resume the session of primary account, which receives the messages and the seen pointer
+    char *tmpSession = login(a1, sessionPrimary);
+    delete [] tmpSession;
+    tmpSession = NULL;
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    loadHistory(a1, chatid, chatroomListener);
+
+    MegaChatListItem *item = megaChatApi[a1]->getChatListItem(chatid);
+    ASSERT_CHAT_TEST(item, "Cannot get chat list item for chat " + std::to_string(chatid));
+    int unreadCount = item->getUnreadCount();
+    delete item;
+    item = NULL;
+    ASSERT_CHAT_TEST(unreadCount == 0, "Wrong unread count after messages seen from another session. Count: " + std::to_string(unreadCount));
+
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
+
+    delete [] sessionPrimary;
+    sessionPrimary = NULL;
+}
+
 /**
  * @brief TEST_OfflineMode
  *
@@ -2857,6 +3060,7 @@ TestChatRoomListener::TestChatRoomListener(MegaChatApiTest *t, MegaChatApi **api
         this->msgRevokeAttachmentReceived[i] = false;
         this->mConfirmedMessageHandle[i] = MEGACHAT_INVALID_HANDLE;
         this->mEditedMessageHandle[i] = MEGACHAT_INVALID_HANDLE;
+        this->mRejectedMessageRowId[i] = MEGACHAT_INVALID_HANDLE;
     }
 }
 
@@ -2939,6 +3143,7 @@ void TestChatRoomListener::onMessageLoaded(MegaChatApi *api, MegaChatMessage *ms
         {
             if (msg->getCode() == MegaChatMessage::REASON_NO_WRITE_ACCESS)
             {
+                mRejectedMessageRowId[apiIndex] = msg->getRowId();
                 msgRejected[apiIndex] = true;
             }
         }
@@ -176,6 +176,8 @@ public:
     void TEST_GetChatRoomsAndMessages(unsigned int accountIndex);
     void TEST_EditAndDeleteMessages(unsigned int a1, unsigned int a2);
     void TEST_GroupChatManagement(unsigned int a1, unsigned int a2);
+    void TEST_RejectedMessageToManualSending(unsigned int a1, unsigned int a2);
+    void TEST_UnreadCountSeenBeforeDecrypt(unsigned int a1, unsigned int a2);
     void TEST_OfflineMode(unsigned int accountIndex);
     void TEST_ClearHistory(unsigned int a1, unsigned int a2);
     void TEST_SwitchAccounts(unsigned int a1, unsigned int a2);
@@ -338,6 +340,7 @@ public:
     bool msgRevokeAttachmentReceived[NUM_ACCOUNTS];
     megachat::MegaChatHandle mConfirmedMessageHandle[NUM_ACCOUNTS];
     megachat::MegaChatHandle mEditedMessageHandle[NUM_ACCOUNTS];
+    megachat::MegaChatHandle mRejectedMessageRowId[NUM_ACCOUNTS];
 
     megachat::MegaChatMessage *message;
     std::vector <megachat::MegaChatHandle>msgId[NUM_ACCOUNTS];
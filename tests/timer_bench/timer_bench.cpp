@@ -0,0 +1,79 @@
+/**
+ * Benchmark of the karere timers, i.e. setTimeout() and cancelTimeout() on
+ * the TimerWheel of an app context, driven by a libevent loop. It measures
+ * arming and canceling a batch of timers with delays from 1 s to 10 min, the
+ * typical retry and keepalive timers, and then how late a batch of timers
+ * spread over 2 s fires.
+ *
+ * Usage: timer_bench [count]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include <event2/event.h>
+#include <event2/thread.h>
+#include "timers.hpp"
+
+GcmPostFunc megaPostMessageToGui = nullptr;
+static eventloop* gLoop = nullptr;
+
+namespace karere
+{
+eventloop* get_ev_loop(void*) { return gLoop; }
+TimerWheel& get_timer_wheel(void*) { static TimerWheel wheel(nullptr); return wheel; }
+}
+
+using namespace karere;
+
+static double msSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned count = (argc > 1) ? atoi(argv[1]) : 100000;
+    evthread_use_pthreads();
+    gLoop = event_base_new();
+    //the loop runs in this thread, so messages can be processed right away
+    megaPostMessageToGui = [](void* msg, void*) { megaProcessMessage(msg); };
+
+    std::vector<megaHandle> handles(count);
+    for (int rep = 0; rep < 3; rep++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < count; i++)
+        {
+            handles[i] = setTimeout([]() {}, 1000 + (i * 7919) % 600000, nullptr);
+        }
+        double armMs = msSince(start);
+        start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < count; i++)
+        {
+            cancelTimeout(handles[i], nullptr);
+        }
+        double cancelMs = msSince(start);
+        printf("arm %u timers: %.1f ms, cancel them: %.1f ms\n", count, armMs, cancelMs);
+    }
+
+    unsigned fired = 0;
+    double maxLateMs = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < count; i++)
+    {
+        unsigned delay = (i * 13) % 2000;
+        setTimeout([&fired, &maxLateMs, count, start, delay]()
+        {
+            double late = msSince(start) - delay;
+            if (late > maxLateMs)
+                maxLateMs = late;
+            if (++fired == count)
+                event_base_loopbreak(gLoop);
+        }, delay, nullptr);
+    }
+    event_base_dispatch(gLoop);
+    printf("%u timers spread over 2 s: all fired after %.0f ms, at most %.1f ms late\n",
+           count, msSince(start), maxLateMs);
+    return 0;
+}
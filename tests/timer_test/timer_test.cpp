@@ -0,0 +1,168 @@
+/**
+ * Unit test of karere::TimerWheel. The wheel is driven with a virtual clock,
+ * so the exact tick at which each timer fires is checked: timers of every
+ * level of the wheel have to be cascaded down to the first one and fire on
+ * time. It also checks that timers canceled from a callback, including the
+ * running one, are not fired and are freed exactly once.
+ *
+ * Usage: timer_test
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include "timers.hpp"
+
+GcmPostFunc megaPostMessageToGui = nullptr;
+
+namespace karere
+{
+eventloop* get_ev_loop(void*) { return nullptr; }
+TimerWheel& get_timer_wheel(void*) { static TimerWheel wheel(nullptr); return wheel; }
+}
+
+using namespace karere;
+
+static int gFailures = 0;
+#define CHECK(cond, ...)                                            \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("FAILED (line %d): ", __LINE__);                 \
+            printf(__VA_ARGS__);                                    \
+            printf("\n");                                           \
+            gFailures++;                                            \
+        }                                                           \
+    } while(0)
+
+static int gLiveTimers = 0;
+
+struct TestTimer: public WheelTimer
+{
+    std::function<void()> cb;
+    TestTimer(std::function<void()>&& aCb): cb(std::move(aCb)) { gLiveTimers++; }
+    ~TestTimer() { gLiveTimers--; }
+    virtual void fire() { cb(); }
+};
+
+/** A wheel whose time only advances when the test says so. Timers are
+ * scheduled directly for an absolute tick, and the driver is never armed */
+class TestWheel: public TimerWheel
+{
+public:
+    TestWheel(): TimerWheel(nullptr) {}
+    megaHandle addAt(uint64_t expires, unsigned period, std::function<void()>&& cb)
+    {
+        WheelTimer* timer = new TestTimer(std::move(cb));
+        timer->handle = ++mHandleCtr;
+        timer->period = period;
+        timer->expires = expires;
+        mTimers[timer->handle] = timer;
+        schedule(timer);
+        return timer->handle;
+    }
+    void advanceTo(uint64_t tick) { advance(tick); }
+    /** The tick being processed, when called from a callback */
+    uint64_t current() const { return mNow - 1; }
+};
+
+static void testCascade()
+{
+    //the first tick of each level, and its neighbours
+    std::vector<uint64_t> ticks = { 0, 1, 255, 256, 257, 300, 16383, 16384, 16385,
+        100000, (1 << 20) - 1, 1 << 20, (1 << 20) + 1, 5000000, (1 << 26) + 3 };
+    TestWheel wheel;
+    std::vector<uint64_t> firedAt(ticks.size(), UINT64_MAX);
+    for (size_t i = 0; i < ticks.size(); i++)
+    {
+        wheel.addAt(ticks[i], 0, [&wheel, &firedAt, i]() { firedAt[i] = wheel.current(); });
+    }
+    for (size_t i = 0; i < ticks.size(); i++)
+    {
+        if (ticks[i])
+        {
+            wheel.advanceTo(ticks[i] - 1);
+            CHECK(firedAt[i] == UINT64_MAX, "timer for tick %llu fired early, at %llu",
+                  (unsigned long long)ticks[i], (unsigned long long)firedAt[i]);
+        }
+        wheel.advanceTo(ticks[i]);
+        CHECK(firedAt[i] == ticks[i], "timer for tick %llu fired at %llu",
+              (unsigned long long)ticks[i], (unsigned long long)firedAt[i]);
+    }
+    CHECK(wheel.size() == 0, "%zu timers left in the wheel", wheel.size());
+}
+
+static void testInterval()
+{
+    TestWheel wheel;
+    std::vector<uint64_t> firedAt;
+    //a period that doesn't divide the size of the first level, so it cascades
+    megaHandle handle = wheel.addAt(300, 300, [&wheel, &firedAt]() { firedAt.push_back(wheel.current()); });
+    wheel.advanceTo(1000);
+    CHECK(firedAt == std::vector<uint64_t>({ 300, 600, 900 }), "interval fired %zu times", firedAt.size());
+    CHECK(wheel.cancel(handle), "can't cancel an interval");
+    wheel.advanceTo(2000);
+    CHECK(firedAt.size() == 3, "canceled interval fired");
+    CHECK(!wheel.cancel(handle), "interval canceled twice");
+}
+
+static void testCancelInCallback()
+{
+    TestWheel wheel;
+    unsigned fired = 0;
+    //a one-shot timer is already removed when it fires, so it can't cancel itself
+    megaHandle oneShot = 0;
+    bool canceledOneShot = true;
+    oneShot = wheel.addAt(10, 0, [&]() { fired++; canceledOneShot = wheel.cancel(oneShot); });
+    //an interval that cancels itself is freed after the callback returns
+    megaHandle interval = 0;
+    interval = wheel.addAt(10, 5, [&]() { fired++; CHECK(wheel.cancel(interval), "interval can't cancel itself"); });
+    //cancels a timer of the same slot that hasn't fired yet, and one of a later slot
+    megaHandle sameSlot = 0, laterSlot = 0;
+    wheel.addAt(20, 0, [&]()
+    {
+        fired++;
+        CHECK(wheel.cancel(sameSlot), "can't cancel a timer of the same slot");
+        CHECK(wheel.cancel(laterSlot), "can't cancel a timer of a later slot");
+    });
+    sameSlot = wheel.addAt(20, 0, [&]() { fired++; CHECK(false, "canceled timer of the same slot fired"); });
+    laterSlot = wheel.addAt(5000, 0, [&]() { fired++; CHECK(false, "canceled timer of a later slot fired"); });
+    //a timer added by a callback for the current tick fires on the next one
+    uint64_t addedFiredAt = 0;
+    wheel.addAt(30, 0, [&]()
+    {
+        fired++;
+        wheel.addAt(30, 0, [&]() { fired++; addedFiredAt = wheel.current(); });
+    });
+
+    wheel.advanceTo(10000);
+    CHECK(!canceledOneShot, "one-shot timer canceled itself while firing");
+    CHECK(addedFiredAt == 31, "timer added for the current tick fired at %llu", (unsigned long long)addedFiredAt);
+    CHECK(fired == 5, "%u timers fired, expected 5", fired);
+    CHECK(wheel.size() == 0, "%zu timers left in the wheel", wheel.size());
+    CHECK(gLiveTimers == 0, "%d timers not freed", gLiveTimers);
+}
+
+static void testDestroy()
+{
+    {
+        TestWheel wheel;
+        wheel.addAt(10, 0, []() {});
+        wheel.addAt(100000, 10, []() {});
+    }
+    CHECK(gLiveTimers == 0, "%d timers not freed by the destructor of the wheel", gLiveTimers);
+}
+
+int main()
+{
+    testCascade();
+    testInterval();
+    testCancelInCallback();
+    testDestroy();
+    if (gFailures)
+    {
+        printf("%d checks failed\n", gFailures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
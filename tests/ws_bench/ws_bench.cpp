@@ -0,0 +1,179 @@
+/**
+ * Loopback throughput benchmark of the way LibwsIO dispatches socket reads and
+ * received websocket messages to the karere thread. A writer thread streams
+ * fixed-size frames over a socketpair. The loop thread reads them with a
+ * bufferevent of its libevent loop, as libws does, splits the frames and
+ * delivers them through the app queue (karere::EventQueue), which it drains
+ * after every loop iteration, as MegaChatApiImpl::loop() does.
+ *
+ * - marshalled: every read callback is wrapped in a marshalled call without app
+ *   context, which is processed right away, and every message is posted as a
+ *   separate marshalled call. This is what LibwsIO used to do.
+ * - direct + coalesced: read callbacks are called directly, and messages are
+ *   queued, so that only the first one of a burst posts a marshalled call that
+ *   delivers all of them. This is what LibwsIO does when the libevent loop is
+ *   run by a LibeventWaiter.
+ *
+ * libws itself isn't needed: its websocket framing costs the same in both modes.
+ *
+ * Usage: ws_bench [frames] [frameSize]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/thread.h>
+#include "eventQueue.h"
+
+/** Stands for the message allocated by karere::marshallCall() */
+struct CallMsg: public megaMessage
+{
+    std::function<void()> func;
+    CallMsg(std::function<void()>&& aFunc)
+    : megaMessage([](void* msg)
+      {
+          CallMsg* self = static_cast<CallMsg*>(msg);
+          self->func();
+          delete self;
+      }), func(std::move(aFunc)) {}
+};
+
+struct Bench
+{
+    bool direct;
+    unsigned frames;
+    size_t frameSize;
+    event_base* loop;
+    karere::EventQueue appQueue;
+    unsigned delivered = 0;
+    std::vector<std::string> pendingMsgs;
+    std::vector<char> readBuf;
+
+    Bench(bool aDirect, unsigned aFrames, size_t aFrameSize)
+    : direct(aDirect), frames(aFrames), frameSize(aFrameSize), loop(event_base_new()),
+      readBuf(aFrameSize) {}
+    ~Bench() { event_base_free(loop); }
+
+    /** marshallCall() with an app context: runs in the next drain of the app queue */
+    void post(std::function<void()>&& func)
+    {
+        appQueue.push(new CallMsg(std::move(func)));
+    }
+    /** marshallCall() without app context: runs right away */
+    void call(std::function<void()>&& func)
+    {
+        megaMessage* msg = new CallMsg(std::move(func));
+        msg->func(msg);
+    }
+    void deliver(const std::string& msg)
+    {
+        (void)msg;
+        delivered++;
+    }
+    void onMsg(const char* data)
+    {
+        if (!direct)
+        {
+            std::string msg(data, frameSize);
+            post([this, msg]() { deliver(msg); });
+            return;
+        }
+        pendingMsgs.emplace_back(data, frameSize);
+        if (pendingMsgs.size() > 1)
+            return;
+        post([this]()
+        {
+            std::vector<std::string> msgs;
+            msgs.swap(pendingMsgs);
+            for (auto& msg: msgs)
+            {
+                deliver(msg);
+            }
+        });
+    }
+    void read(bufferevent* bev)
+    {
+        evbuffer* input = bufferevent_get_input(bev);
+        while (evbuffer_get_length(input) >= frameSize)
+        {
+            evbuffer_remove(input, readBuf.data(), frameSize);
+            onMsg(readBuf.data());
+        }
+    }
+    static void readCb(bufferevent* bev, void* arg)
+    {
+        Bench* self = static_cast<Bench*>(arg);
+        if (self->direct)
+        {
+            self->read(bev);
+        }
+        else
+        {
+            self->call([self, bev]() { self->read(bev); });
+        }
+    }
+    double run()
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+        {
+            perror("socketpair");
+            exit(1);
+        }
+        bufferevent* bev = bufferevent_socket_new(loop, fds[0], 0);
+        bufferevent_setcb(bev, readCb, nullptr, nullptr, this);
+        bufferevent_enable(bev, EV_READ);
+
+        auto start = std::chrono::steady_clock::now();
+        std::thread writer([this, &fds]()
+        {
+            //write several frames at once, as the server does when it has a backlog
+            std::vector<char> buf(frameSize * 64, 'x');
+            size_t total = frameSize * frames;
+            while (total)
+            {
+                size_t len = std::min(total, buf.size());
+                ssize_t ret = write(fds[1], buf.data(), len);
+                if (ret > 0)
+                    total -= ret;
+            }
+        });
+        while (delivered < frames)
+        {
+            event_base_loop(loop, EVLOOP_ONCE);
+            while (megaMessage* msg = static_cast<megaMessage*>(appQueue.pop()))
+            {
+                msg->func(msg);
+            }
+        }
+        writer.join();
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        bufferevent_free(bev);
+        close(fds[1]);
+        return frames / secs;
+    }
+};
+
+int main(int argc, char* argv[])
+{
+    unsigned frames = (argc > 1) ? atoi(argv[1]) : 512000;
+    size_t frameSize = (argc > 2) ? atoi(argv[2]) : 64;
+    evthread_use_pthreads();
+    printf("%u frames of %zu bytes\n", frames, frameSize);
+    for (int rep = 0; rep < 3; rep++)
+    {
+        double marshalled = Bench(false, frames, frameSize).run();
+        double direct = Bench(true, frames, frameSize).run();
+        printf("marshalled: %.2fM msgs/s   direct + coalesced: %.2fM msgs/s\n", marshalled / 1e6, direct / 1e6);
+    }
+    return 0;
+}